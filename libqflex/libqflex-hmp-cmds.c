@@ -11,6 +11,8 @@
 #include "middleware/trace.h"
 #include "libqflex-module.h"
 #include "libqflex.h"
+#include "libqflex-prof.h"
+#include "plugins/trace/trace.h"
 
 void
 hmp_flexus_save_measure(Monitor *mon, const QDict *qdict) {
@@ -28,6 +30,84 @@ hmp_flexus_save_measure(Monitor *mon, const QDict *qdict) {
     hmp_handle_error(mon, err);
 }
 
+/**
+ * Print the per-vCPU counters of the trace mode. The instruction mix is only
+ * there with stats=on or trace-mode=count.
+ */
+void
+hmp_flexus_stats(Monitor *mon, const QDict *qdict)
+{
+    if (! qemu_libqflex_state.is_running ||
+        qemu_libqflex_state.mode != MODE_TRACE)
+    {
+        monitor_printf(mon, "Statistics are only collected by a running `libqflex' trace mode.\n");
+        return;
+    }
+
+    g_autoptr(GString) stats = g_string_new("");
+    trace_count_dump(stats, qemu_libqflex_state.n_vcpus, qemu_libqflex_state.stats);
+
+    monitor_puts(mon, stats->str);
+}
+
+/**
+ * Print the latency histograms of the Flexus boundary, with prof=on.
+ */
+void
+hmp_flexus_prof(Monitor *mon, const QDict *qdict)
+{
+    if (! qemu_libqflex_state.is_running || ! qemu_libqflex_state.prof)
+    {
+        monitor_printf(mon, "Latencies are only collected by a running `libqflex' with prof=on.\n");
+        return;
+    }
+
+    g_autoptr(GString) prof = g_string_new("");
+    libqflex_prof_dump(prof);
+
+    monitor_puts(mon, prof->str);
+}
+
+/**
+ * Print the most contended physical lines, with trace-sink=sharing.
+ */
+void
+hmp_flexus_sharing(Monitor *mon, const QDict *qdict)
+{
+    if (! qemu_libqflex_state.is_running ||
+        qemu_libqflex_state.mode != MODE_TRACE ||
+        ! (qemu_libqflex_state.trace_sinks & TRACE_SINK_SHARING))
+    {
+        monitor_printf(mon, "Sharing is only tracked by a running `libqflex' trace mode with trace-sink=sharing.\n");
+        return;
+    }
+
+    g_autoptr(GString) sharing = g_string_new("");
+    trace_sharing_dump(sharing, qemu_libqflex_state.sharing_top);
+
+    monitor_puts(mon, sharing->str);
+}
+
+/**
+ * Print the lock contention per vCPU, lock and instruction, with trace-sink=lock.
+ */
+void
+hmp_flexus_locks(Monitor *mon, const QDict *qdict)
+{
+    if (! qemu_libqflex_state.is_running ||
+        qemu_libqflex_state.mode != MODE_TRACE ||
+        ! (qemu_libqflex_state.trace_sinks & TRACE_SINK_LOCK))
+    {
+        monitor_printf(mon, "Locks are only profiled by a running `libqflex' trace mode with trace-sink=lock.\n");
+        return;
+    }
+
+    g_autoptr(GString) locks = g_string_new("");
+    trace_lock_dump(locks, qemu_libqflex_state.lock_top);
+
+    monitor_puts(mon, locks->str);
+}
+
 void
 hmp_flexus_save_ckpt(Monitor* mon, const QDict* qdict)
 {
@@ -37,6 +37,34 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+/**
+ * Version of the QEMU <-> Flexus interface.
+ *
+ * 1: FLEXUS_API_t with `trace_mem' only, one call per event.
+ * 2: adds `trace_mem_batch', a contiguous array of events of one vCPU.
+ * 3: adds QEMU_Trans_Instr_Block events, one per executed translation
+ *    block, sent when QEMU runs with -libqflex trace-mode=block.
+ * 4: adds QEMU_API_t `get_insn_count', executed instructions of a vCPU.
+ * 5: adds `sample_phase', called when the sampling schedule of the trace
+ *    mode moves to another phase.
+ * 6: adds `static_insn', which publishes the static instruction dictionary,
+ *    and `insn_id' in memory_transaction_t. Events of an instruction carry
+ *    the ID of its dictionary entry. Called from the translating vCPU
+ *    threads, possibly several at once.
+ * 7: adds `trace_mem_ordered', which receives the events of every vCPU in
+ *    one order, from a single thread, with their trace_stamp_t. Used with
+ *    -libqflex trace-order=on, where `sample_phase' and `static_insn' are
+ *    called from that thread too.
+ * 8: adds `spin_skip', called in timing mode when a vCPU parked on a spin
+ *    loop resumes, with the instructions and cycles it skipped. Used with
+ *    -libqflex spin=on.
+ *
+ * Flexus advertises the version it implements by exporting
+ * `flexus_api_version' (see FLEXUS_API_VERSION_t). A library without this
+ * symbol is considered to be version 1.
+ */
+#define LIBQFLEX_API_VERSION (8)
+
 typedef void*     conf_class_t;
 typedef uint32_t  exception_type_t;
 typedef uint64_t  cycles_t;
@@ -122,7 +150,8 @@ typedef enum {
   QEMU_Trans_Store,
   QEMU_Trans_Instr_Fetch,
   QEMU_Trans_Prefetch,
-  QEMU_Trans_Cache
+  QEMU_Trans_Cache,
+  QEMU_Trans_Instr_Block,   // Fetch of a whole block, see block_data_t
 } mem_op_type_t;
 
 typedef enum {
@@ -142,6 +171,13 @@ typedef enum {
   QEMU_BRANCH_TYPE_COUNT
 } branch_type_t;
 
+typedef enum {
+  QEMU_Sample_Skip   = 0,   // No event is sent
+  QEMU_Sample_Warm   = 1,   // Events to warm the model, not to be measured
+  QEMU_Sample_Detail = 2,   // Events to be measured
+  QEMU_Sample_Phase_Count
+} sample_phase_t;
+
 typedef enum {
   QEMU_Instruction_Cache = 1,
   QEMU_Data_Cache        = 2
@@ -174,7 +210,7 @@ typedef struct exception_t{
 typedef struct {
   logical_address_t   pc;
   logical_address_t   logical_address;
-  logical_address_t   target_address;
+  logical_address_t   target_address;   // next PC of a branch fetch, 0 when unknown
   physical_address_t  physical_address;
   uint32_t            opcode;
   size_t              size;
@@ -200,6 +236,47 @@ typedef struct address_range {
   physical_address_t end_paddr;
 } address_range_t;
 
+/**
+ * Static content of an executed block (QEMU_Trans_Instr_Block).
+ * Instructions are contiguous from `s.pc', 4 bytes each. The event is sent
+ * when the block is entered: when an exception leaves it early, the
+ * instructions after the faulting one are listed but did not execute.
+ * `opcodes' is owned by QEMU and only valid during the trace_mem call.
+ */
+typedef struct block_data {
+  uint32_t const *   opcodes;
+  uint32_t           n_insns;
+} block_data_t;
+
+
+/**
+ * Entry of the static instruction dictionary (version 6). An ID is given
+ * once per instruction PC, physical address, opcode and EL, and is never
+ * reused during a run. 0 is never a valid ID.
+ */
+typedef struct static_insn {
+  uint32_t           id;
+  uint32_t           opcode;
+  logical_address_t  pc;
+  physical_address_t physical_address;
+  uint8_t            size;
+  uint8_t            exception;
+  uint8_t            branch_type;   // branch_type_t
+  uint8_t            mem_size;      // bytes per access, 0 without memory access
+  uint8_t            is_load   : 1;
+  uint8_t            is_store  : 1;
+  uint8_t            is_atomic : 1;
+} static_insn_t;
+
+/**
+ * Position of an event in the ordered stream (version 7).
+ */
+typedef struct trace_stamp {
+  // Instructions executed by the vCPU when the event was emitted
+  uint64_t           icount;
+  // Rank of the event among the events of every vCPU, from 0
+  uint64_t           seq;
+} trace_stamp_t;
 
 typedef struct {
   generic_transaction_t  s;
@@ -210,9 +287,14 @@ typedef struct {
   uint8_t line               : 1;  // 1 for line, 0 for whole cache
   uint8_t data_is_set_and_way: 1;  // wether or not the operation provides set&way or address (range)
 
+  // Version 6, static_insn_t of the instruction, 0 if none. Fits in what
+  // used to be padding, the layout is unchanged.
+  uint32_t insn_id;
+
   union{
     set_and_way_data_t set_and_way;
     address_range_t    addr_range;               // same start and end addresses for not range operations
+    block_data_t       block;                    // QEMU_Trans_Instr_Block only
   };
 
 } memory_transaction_t;
@@ -246,18 +328,40 @@ typedef void              (*QEMU_GET_MEM_t)         (uint8_t* buffer, physical_a
 typedef void              (*QEMU_STOP_t)            (char const * const msg);
 typedef char*             (*QEMU_DISASS_t)          (size_t core_index, uint64_t addr, size_t size);
 typedef bool              (*QEMU_CPU_BUSY_t)        (size_t core_index);
+typedef uint64_t          (*QEMU_GET_INSN_COUNT_t)  (size_t core_index);
 // ─────────────────────────────────────────────────────────────────────────────
 
 typedef void              (*FLEXUS_START_t)        (uint64_t);
 typedef void              (*FLEXUS_STOP_t)         (void);
 typedef void              (*FLEXUS_QMP_t)          (qmp_flexus_cmd_t, const char *);
 typedef void              (*FLEXUS_TRACE_MEM_t)    (uint64_t, memory_transaction_t *);
+typedef void              (*FLEXUS_TRACE_MEM_BATCH_t)(uint64_t, memory_transaction_t *, size_t);
+// Receive the version QEMU implements, return the one both sides agree on
+typedef uint32_t          (*FLEXUS_API_VERSION_t)  (uint32_t);
+typedef void              (*FLEXUS_SAMPLE_PHASE_t) (sample_phase_t);
+typedef void              (*FLEXUS_STATIC_INSN_t)  (static_insn_t const *);
+typedef void              (*FLEXUS_TRACE_MEM_ORDERED_t)(uint64_t, memory_transaction_t *, trace_stamp_t const *, size_t);
+typedef void              (*FLEXUS_SPIN_SKIP_t)    (uint64_t core_index, uint64_t insns, uint64_t cycles);
 
 typedef struct FLEXUS_API_t {
   FLEXUS_START_t          start;
   FLEXUS_STOP_t           stop;
   FLEXUS_QMP_t            qmp;
   FLEXUS_TRACE_MEM_t      trace_mem;
+  // ─── Version 2 ───────────────────────────────────────────────────────
+  FLEXUS_TRACE_MEM_BATCH_t trace_mem_batch;
+  // ─── Version 5 ───────────────────────────────────────────────────────
+  FLEXUS_SAMPLE_PHASE_t   sample_phase;
+  // ─── Version 6 ───────────────────────────────────────────────────────
+  // Called from the translating vCPU thread, before any event of the ID
+  FLEXUS_STATIC_INSN_t    static_insn;
+  // ─── Version 7 ───────────────────────────────────────────────────────
+  // Events of one vCPU, consecutive in the ordered stream
+  FLEXUS_TRACE_MEM_ORDERED_t trace_mem_ordered;
+  // ─── Version 8 ───────────────────────────────────────────────────────
+  // The vCPU was idle (is_busy false) while parked, account the skipped
+  // spin loop as committed instructions over those cycles
+  FLEXUS_SPIN_SKIP_t      spin_skip;
 } FLEXUS_API_t;
 
 typedef struct QEMU_API_t
@@ -287,6 +391,8 @@ typedef struct QEMU_API_t
   QEMU_TICK_t            tick;
   QEMU_DISASS_t          disassembly;
   QEMU_CPU_BUSY_t        is_busy;
+  // ─── Version 4 ───────────────────────────────────────────────────────
+  QEMU_GET_INSN_COUNT_t  get_insn_count;
   // ─────────────────────────────────────────────────────────────────────
 
 
@@ -300,6 +406,13 @@ extern FLEXUS_API_t flexus_api;
   void FLEXUS_stop     (void);
   void FLEXUS_qmp      (qmp_flexus_cmd_t, const char*);
   void FLEXUS_trace_mem(uint64_t, memory_transaction_t*);
+  void FLEXUS_trace_mem_batch(uint64_t, memory_transaction_t*, size_t);
+  void FLEXUS_sample_phase(sample_phase_t);
+  void FLEXUS_static_insn(static_insn_t const*);
+  void FLEXUS_trace_mem_ordered(uint64_t, memory_transaction_t*, trace_stamp_t const*, size_t);
+  void FLEXUS_spin_skip(uint64_t, uint64_t, uint64_t);
+
+  uint32_t flexus_api_version(uint32_t);
 
   void   QEMU_get_api(  QEMU_API_t *api);
   void FLEXUS_get_api(FLEXUS_API_t *api);
@@ -7,12 +7,15 @@
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
 #include "qemu/log.h"
+#include "qemu/cutils.h"
 #include "qemu/option.h"
 #include "sysemu/tcg.h"
 
 #include "libqflex-legacy-api.h"
 #include "libqflex-module.h"
 #include "libqflex.h"
+#include "libqflex-prof.h"
+#include "libqflex-spin.h"
 #include "plugins/trace/trace.h"
 
 
@@ -61,6 +64,176 @@ QemuOptsList qemu_libqflex_opts = {
             .name = "debug",
             .type = QEMU_OPT_STRING,
 
+        },
+        {
+            .name = "trace-mode",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "sample-skip",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "sample-warm",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "sample-detail",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "filter-va",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "filter-pa",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "filter-el",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "filter-class",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "trace-file",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "trace-file-chunk",
+            .type = QEMU_OPT_SIZE,
+
+        },
+        {
+            .name = "trace-sink",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "reuse-file",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "reuse-rate",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "reuse-entries",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "reuse-interval",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "bbv-file",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "bbv-interval",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "sharing-lines",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "sharing-top",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "lock-top",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "prof",
+            .type = QEMU_OPT_BOOL,
+
+        },
+        {
+            .name = "prof-rate",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "spin",
+            .type = QEMU_OPT_BOOL,
+
+        },
+        {
+            .name = "spin-threshold",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "spin-max-park",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "stats",
+            .type = QEMU_OPT_BOOL,
+
+        },
+        {
+            .name = "trace-disas",
+            .type = QEMU_OPT_BOOL,
+
+        },
+        {
+            .name = "trace-branch",
+            .type = QEMU_OPT_BOOL,
+
+        },
+        {
+            .name = "insn-dict",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "trace-encoding",
+            .type = QEMU_OPT_STRING,
+
+        },
+        {
+            .name = "trace-order",
+            .type = QEMU_OPT_BOOL,
+
+        },
+        {
+            .name = "order-quantum",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "ring-size",
+            .type = QEMU_OPT_NUMBER,
+
+        },
+        {
+            .name = "ring-consumers",
+            .type = QEMU_OPT_NUMBER,
+
         },
         { /* end of list */ }
     },
@@ -76,8 +249,45 @@ struct libqflex_state_t qemu_libqflex_state = {
     .ckpt_path      = "",
     .cycles         = 0,
     .cycles_mask    = 0,
+    .trace_mode     = TRACE_MODE_INSN,
+    .sample_skip    = 0,
+    .sample_warm    = 0,
+    .sample_detail  = 0,
+    .filter_va_lo   = 0,
+    .filter_va_hi   = UINT64_MAX,
+    .filter_pa_lo   = 0,
+    .filter_pa_hi   = UINT64_MAX,
+    .filter_el_mask = 0xf,
+    .filter_class   = TRACE_CLASS_ALL,
+    .trace_file     = NULL,
+    .trace_file_chunk = 0,
+    .trace_sinks      = 0,
+    .reuse_file       = NULL,
+    .reuse_rate       = 100,
+    .reuse_entries    = 8192,
+    .reuse_interval   = 0,
+    .bbv_file         = NULL,
+    .bbv_interval     = 100000000,
+    .sharing_lines    = 65536,
+    .sharing_top      = 16,
+    .lock_top         = 16,
+    .stats            = false,
+    .prof             = false,
+    .prof_rate        = 1,
+    .spin             = false,
+    .spin_threshold   = 64,
+    .spin_max_park    = 1000000,
+    .trace_disas      = false,
+    .trace_branch     = false,
+    .insn_dict        = NULL,
+    .trace_encoding   = TRACE_ENCODING_RAW,
+    .trace_order    = false,
+    .order_quantum  = 10000,
+    .ring_size      = 0,
+    .ring_consumers = 0,
     .debug_lvl      = "vverb",
     .mode           = MODE_TRACE,
+    .api_version    = 1,
 };
 
 // ─── Local Variable ──────────────────────────────────────────────────────────
@@ -85,6 +295,71 @@ struct libqflex_state_t qemu_libqflex_state = {
 
 // ─── Static Function ─────────────────────────────────────────────────────────
 
+/**
+ * Parse an inclusive address range written `lo:hi', either bound may be
+ * omitted. Exit on malformed input.
+ */
+static void
+libqflex_parse_range(char const * name, char const * str, uint64_t* lo, uint64_t* hi)
+{
+    g_auto(GStrv) bounds = g_strsplit(str, ":", 2);
+
+    if (g_strv_length(bounds) != 2 ||
+        (*bounds[0] && qemu_strtou64(bounds[0], NULL, 0, lo)) ||
+        (*bounds[1] && qemu_strtou64(bounds[1], NULL, 0, hi)) ||
+        *lo > *hi)
+    {
+        error_report("ERROR: %s expects <lo>:<hi>, got '%s'", name, str);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Parse a list of trace sinks written `flexus:file', into TRACE_SINK_* bits.
+ */
+static uint32_t
+libqflex_parse_sinks(char const * str)
+{
+    g_auto(GStrv) names = g_strsplit(str, ":", -1);
+    uint32_t mask = 0;
+
+    for (size_t i = 0; names[i]; i++)
+    {
+        uint32_t const sink = trace_sink_parse(names[i]);
+        if (!sink)
+        {
+            error_report("ERROR: unknown trace-sink '%s', expects flexus, file, stats, null, reuse, sharing or lock", names[i]);
+            exit(EXIT_FAILURE);
+        }
+        mask |= sink;
+    }
+
+    return mask;
+}
+
+/**
+ * Parse a list of exception levels written `0:1', into one bit per level.
+ */
+static uint32_t
+libqflex_parse_el(char const * str)
+{
+    g_auto(GStrv) levels = g_strsplit(str, ":", -1);
+    uint32_t mask = 0;
+
+    for (size_t i = 0; levels[i]; i++)
+    {
+        uint64_t el;
+        if (qemu_strtou64(levels[i], NULL, 10, &el) || el > 3)
+        {
+            error_report("ERROR: filter-el expects levels 0 to 3, got '%s'", str);
+            exit(EXIT_FAILURE);
+        }
+        mask |= 1 << el;
+    }
+
+    return mask;
+}
+
 
 
 static bool
@@ -116,6 +391,12 @@ libqflex_flexus_init(void)
         return false;
     }
 
+    // Optional, libraries older than version 2 do not export it
+    FLEXUS_API_VERSION_t version = NULL;
+    qemu_libqflex_state.api_version = 1;
+    if ((version = (FLEXUS_API_VERSION_t)(dlsym(handle, "flexus_api_version"))) != NULL)
+        qemu_libqflex_state.api_version = MIN(version(LIBQFLEX_API_VERSION), LIBQFLEX_API_VERSION);
+
     QEMU_API_t qemu_api =
     {
         .read_register      = libqflex_read_register,
@@ -130,8 +411,15 @@ libqflex_flexus_init(void)
         .tick               = libqflex_tick,
         .disassembly        = libqflex_disas,
         .is_busy            = libqflex_is_core_busy,
+        .get_insn_count     = libqflex_get_instruction_count,
     };
 
+    if (qemu_libqflex_state.prof)
+    {
+        libqflex_prof_init(qemu_libqflex_state.n_vcpus, qemu_libqflex_state.prof_rate);
+        libqflex_prof_wrap_qemu(&qemu_api);
+    }
+
     // Flexus is stupid, so it's to put with its stupidity
     g_autoptr(GString) nb_cycles = g_string_new("");
     g_string_printf(nb_cycles, "%d", qemu_libqflex_state.cycles);
@@ -145,6 +433,45 @@ libqflex_flexus_init(void)
         "." // CWD
     );
 
+    if (qemu_libqflex_state.api_version >= 2 && !flexus_api.trace_mem_batch)
+    {
+        warn_report("Flexus advertised API version %u without trace_mem_batch, "
+                    "falling back to version 1", qemu_libqflex_state.api_version);
+        qemu_libqflex_state.api_version = 1;
+    }
+
+    if (qemu_libqflex_state.api_version >= 5 && !flexus_api.sample_phase)
+    {
+        warn_report("Flexus advertised API version %u without sample_phase, "
+                    "falling back to version 4", qemu_libqflex_state.api_version);
+        qemu_libqflex_state.api_version = 4;
+    }
+
+    if (qemu_libqflex_state.api_version >= 6 && !flexus_api.static_insn)
+    {
+        warn_report("Flexus advertised API version %u without static_insn, "
+                    "falling back to version 5", qemu_libqflex_state.api_version);
+        qemu_libqflex_state.api_version = 5;
+    }
+
+    if (qemu_libqflex_state.api_version >= 7 && !flexus_api.trace_mem_ordered)
+    {
+        warn_report("Flexus advertised API version %u without trace_mem_ordered, "
+                    "falling back to version 6", qemu_libqflex_state.api_version);
+        qemu_libqflex_state.api_version = 6;
+    }
+
+    if (qemu_libqflex_state.api_version >= 8 && !flexus_api.spin_skip)
+    {
+        warn_report("Flexus advertised API version %u without spin_skip, "
+                    "falling back to version 7", qemu_libqflex_state.api_version);
+        qemu_libqflex_state.api_version = 7;
+    }
+
+    // After the checks above, which look for the entries Flexus left empty
+    if (qemu_libqflex_state.prof)
+        libqflex_prof_wrap_flexus(&flexus_api);
+
     return true;
 }
 
@@ -168,6 +495,13 @@ libqflex_init(void)
     qemu_libqflex_state.n_vcpus = current_machine->smp.cpus;
     libqflex_populate_vcpus(qemu_libqflex_state.n_vcpus);
 
+    // Before Flexus, which may already ask whether vCPUs are busy
+    if (qemu_libqflex_state.spin)
+        libqflex_spin_init(
+            qemu_libqflex_state.n_vcpus,
+            qemu_libqflex_state.spin_threshold,
+            qemu_libqflex_state.spin_max_park);
+
     ret = libqflex_flexus_init();
     if (!ret) exit(EXIT_FAILURE);
 
@@ -186,6 +520,9 @@ libqflex_init(void)
     qemu_log("> [Libqflex] CKPT_PATH    =%s\n", qemu_libqflex_state.ckpt_path);
     qemu_log("> [Libqflex] CYCLES       =%d\n", qemu_libqflex_state.cycles);
     qemu_log("> [Libqflex] DEBUG        =%s\n", qemu_libqflex_state.debug_lvl);
+    qemu_log("> [Libqflex] TRACE_FILE   =%s\n", qemu_libqflex_state.trace_file);
+    qemu_log("> [Libqflex] RING_SIZE    =%d\n", qemu_libqflex_state.ring_size);
+    qemu_log("> [Libqflex] API_VERSION  =%d\n", qemu_libqflex_state.api_version);
 }
 
 // ─────────────────────────────────────────────────────────────────────────────
@@ -206,12 +543,124 @@ libqflex_parse_opts(char const * optarg)
     char const * const cfg_path = qemu_opt_get(opts, "cfg-path");
     char const * const ckpt_path = qemu_opt_get(opts, "ckpt-path");
     char const * const debug_lvl = qemu_opt_get(opts, "debug");
+    char const * const trace_mode = qemu_opt_get(opts, "trace-mode");
     uint32_t const cycles       = qemu_opt_get_number(opts, "cycles", 0);
     uint32_t const cycles_mask  = qemu_opt_get_number(opts, "cycles-mask", 1);
+    uint32_t const ring_size    = qemu_opt_get_number(opts, "ring-size", 0);
+    uint32_t const ring_consumers = qemu_opt_get_number(opts, "ring-consumers", 0);
 
     qemu_libqflex_state.cycles = cycles;
     qemu_libqflex_state.cycles_mask = cycles_mask;
 
+    qemu_libqflex_state.sample_skip   = qemu_opt_get_number(opts, "sample-skip", 0);
+    qemu_libqflex_state.sample_warm   = qemu_opt_get_number(opts, "sample-warm", 0);
+    qemu_libqflex_state.sample_detail = qemu_opt_get_number(opts, "sample-detail", 0);
+
+    if ((qemu_libqflex_state.sample_skip || qemu_libqflex_state.sample_warm) &&
+        !qemu_libqflex_state.sample_detail)
+    {
+        error_report("ERROR: sample-skip and sample-warm need a sample-detail length");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ring_size & (ring_size - 1))
+    {
+        error_report("ERROR: ring-size must be a power of 2");
+        exit(EXIT_FAILURE);
+    }
+    qemu_libqflex_state.ring_size = ring_size;
+    qemu_libqflex_state.ring_consumers = ring_consumers;
+
+    qemu_libqflex_state.trace_order   = qemu_opt_get_bool(opts, "trace-order", false);
+    qemu_libqflex_state.order_quantum = qemu_opt_get_number(opts, "order-quantum", 10000);
+
+    if (qemu_libqflex_state.trace_order && !qemu_libqflex_state.order_quantum)
+    {
+        error_report("ERROR: order-quantum must be at least 1");
+        exit(EXIT_FAILURE);
+    }
+
+    char const * const trace_file = qemu_opt_get(opts, "trace-file");
+    qemu_libqflex_state.trace_file_chunk = qemu_opt_get_size(opts, "trace-file-chunk", 0);
+
+    // Flexus, and the trace file when there is one, unless told otherwise
+    char const * const trace_sink = qemu_opt_get(opts, "trace-sink");
+    if (trace_sink)
+        qemu_libqflex_state.trace_sinks = libqflex_parse_sinks(trace_sink);
+    else
+        qemu_libqflex_state.trace_sinks = TRACE_SINK_FLEXUS | (trace_file ? TRACE_SINK_FILE : 0);
+
+    if ((qemu_libqflex_state.trace_sinks & TRACE_SINK_FILE) && !trace_file)
+    {
+        error_report("ERROR: trace-sink=file needs a trace-file");
+        exit(EXIT_FAILURE);
+    }
+
+    char const * const reuse_file = qemu_opt_get(opts, "reuse-file");
+    if (reuse_file) qemu_libqflex_state.reuse_file = strdup(reuse_file);
+
+    qemu_libqflex_state.reuse_rate     = qemu_opt_get_number(opts, "reuse-rate", 100);
+    qemu_libqflex_state.reuse_entries  = qemu_opt_get_number(opts, "reuse-entries", 8192);
+    qemu_libqflex_state.reuse_interval = qemu_opt_get_number(opts, "reuse-interval", 0);
+
+    char const * const bbv_file = qemu_opt_get(opts, "bbv-file");
+    if (bbv_file) qemu_libqflex_state.bbv_file = strdup(bbv_file);
+
+    qemu_libqflex_state.bbv_interval = qemu_opt_get_number(opts, "bbv-interval", 100000000);
+
+    if (bbv_file && !qemu_libqflex_state.bbv_interval)
+    {
+        error_report("ERROR: bbv-interval must be at least 1");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!qemu_libqflex_state.reuse_rate)
+    {
+        error_report("ERROR: reuse-rate must be at least 1");
+        exit(EXIT_FAILURE);
+    }
+
+    qemu_libqflex_state.sharing_lines = qemu_opt_get_number(opts, "sharing-lines", 65536);
+    qemu_libqflex_state.sharing_top   = qemu_opt_get_number(opts, "sharing-top", 16);
+
+    if (qemu_libqflex_state.sharing_lines < 4)
+    {
+        error_report("ERROR: sharing-lines must be at least 4");
+        exit(EXIT_FAILURE);
+    }
+
+    qemu_libqflex_state.lock_top = qemu_opt_get_number(opts, "lock-top", 16);
+
+    char const * const trace_encoding = qemu_opt_get(opts, "trace-encoding");
+    if (trace_encoding)
+    {
+        if (strcmp(trace_encoding, "raw") == 0)
+            qemu_libqflex_state.trace_encoding = TRACE_ENCODING_RAW;
+        else if (strcmp(trace_encoding, "compact") == 0)
+            qemu_libqflex_state.trace_encoding = TRACE_ENCODING_COMPACT;
+        else
+        {
+            error_report("ERROR: unknown trace-encoding '%s'", trace_encoding);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    qemu_libqflex_state.stats = qemu_opt_get_bool(opts, "stats", false);
+
+    qemu_libqflex_state.prof      = qemu_opt_get_bool(opts, "prof", false);
+    qemu_libqflex_state.prof_rate = qemu_opt_get_number(opts, "prof-rate", 1);
+
+    qemu_libqflex_state.trace_disas  = qemu_opt_get_bool(opts, "trace-disas", false);
+    qemu_libqflex_state.trace_branch = qemu_opt_get_bool(opts, "trace-branch", false);
+
+    qemu_libqflex_state.spin           = qemu_opt_get_bool(opts, "spin", false);
+    qemu_libqflex_state.spin_threshold = qemu_opt_get_number(opts, "spin-threshold", 64);
+    qemu_libqflex_state.spin_max_park  = qemu_opt_get_number(opts, "spin-max-park", 1000000);
+
+    char const * const insn_dict = qemu_opt_get(opts, "insn-dict");
+
+    if (insn_dict) qemu_libqflex_state.insn_dict = strdup(insn_dict);
+    if (trace_file) qemu_libqflex_state.trace_file = strdup(trace_file);
     if (lib_path) qemu_libqflex_state.lib_path = strdup(lib_path);
     if (cfg_path) qemu_libqflex_state.cfg_path = strdup(cfg_path);
     if (debug_lvl) qemu_libqflex_state.debug_lvl = strdup(debug_lvl);
@@ -223,6 +672,73 @@ libqflex_parse_opts(char const * optarg)
         if (strcmp(strdup(mode), "timing") == 0) qemu_libqflex_state.mode = MODE_TIMING;
     }
 
+    if (qemu_libqflex_state.spin && qemu_libqflex_state.mode != MODE_TIMING)
+    {
+        error_report("ERROR: spin only applies to mode=timing");
+        exit(EXIT_FAILURE);
+    }
+
+    char const * const filter_va = qemu_opt_get(opts, "filter-va");
+    char const * const filter_pa = qemu_opt_get(opts, "filter-pa");
+    char const * const filter_el = qemu_opt_get(opts, "filter-el");
+    char const * const filter_class = qemu_opt_get(opts, "filter-class");
+
+    if (filter_va)
+        libqflex_parse_range("filter-va", filter_va,
+            &qemu_libqflex_state.filter_va_lo, &qemu_libqflex_state.filter_va_hi);
+    if (filter_pa)
+        libqflex_parse_range("filter-pa", filter_pa,
+            &qemu_libqflex_state.filter_pa_lo, &qemu_libqflex_state.filter_pa_hi);
+    if (filter_el)
+        qemu_libqflex_state.filter_el_mask = libqflex_parse_el(filter_el);
+
+    if (filter_class)
+    {
+        if (strcmp(filter_class, "all") == 0)
+            qemu_libqflex_state.filter_class = TRACE_CLASS_ALL;
+        else if (strcmp(filter_class, "mem") == 0)
+            qemu_libqflex_state.filter_class = TRACE_CLASS_MEM;
+        else if (strcmp(filter_class, "branch") == 0)
+            qemu_libqflex_state.filter_class = TRACE_CLASS_BRANCH;
+        else
+        {
+            error_report("ERROR: unknown filter-class '%s'", filter_class);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (trace_mode)
+    {
+        if (strcmp(trace_mode, "insn") == 0)
+            qemu_libqflex_state.trace_mode = TRACE_MODE_INSN;
+        else if (strcmp(trace_mode, "block") == 0)
+            qemu_libqflex_state.trace_mode = TRACE_MODE_BLOCK;
+        else if (strcmp(trace_mode, "count") == 0)
+        {
+            qemu_libqflex_state.trace_mode = TRACE_MODE_COUNT;
+            qemu_libqflex_state.stats = true;
+        }
+        else
+        {
+            error_report("ERROR: unknown trace-mode '%s'", trace_mode);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Collected by the trace plugin, in any trace-mode
+    if (qemu_libqflex_state.bbv_file && qemu_libqflex_state.mode != MODE_TRACE)
+    {
+        error_report("ERROR: bbv-file only applies to mode=trace");
+        exit(EXIT_FAILURE);
+    }
+
+    // Targets are attached to the fetch events of the branches
+    if (qemu_libqflex_state.trace_branch && qemu_libqflex_state.trace_mode != TRACE_MODE_INSN)
+    {
+        error_report("ERROR: trace-branch only applies to trace-mode=insn");
+        exit(EXIT_FAILURE);
+    }
+
     qemu_opts_del(opts);
 
     qemu_libqflex_state.is_configured = true;
@@ -13,6 +13,16 @@ typedef void (*FLEXUS_INIT_t)(
     const char *);
 
 extern QemuOptsList qemu_libqflex_opts;
+extern struct libqflex_state_t qemu_libqflex_state;
+
+#define TRACE_SINK_FLEXUS   (1u << 0)
+#define TRACE_SINK_FILE     (1u << 1)
+#define TRACE_SINK_STATS    (1u << 2)
+#define TRACE_SINK_NULL     (1u << 3)
+#define TRACE_SINK_REUSE    (1u << 4)
+#define TRACE_SINK_SHARING  (1u << 5)
+#define TRACE_SINK_LOCK     (1u << 6)
+#define TRACE_SINK_COUNT    (7)
 
 struct libqflex_state_t {
 
@@ -29,8 +39,95 @@ struct libqflex_state_t {
     uint32_t   cycles;
     uint32_t   cycles_mask;
 
+    // Granularity of the instruction stream in trace mode
+    enum { TRACE_MODE_INSN, TRACE_MODE_BLOCK, TRACE_MODE_COUNT, } trace_mode;
+
+    // Instruction mix counters, always on with trace-mode=count
+    bool       stats;
+
+    // Latency histograms of the Flexus boundary, one call in `prof_rate'
+    // timed, see libqflex-prof.h
+    bool       prof;
+    uint32_t   prof_rate;
+
+    // Spin loop fast-forward of the timing mode, a vCPU parked after
+    // `spin_threshold' idle turns for at most `spin_max_park' cycles,
+    // see libqflex-spin.h
+    bool       spin;
+    uint32_t   spin_threshold;
+    uint64_t   spin_max_park;
+
+    // Sampling schedule in trace mode, in instructions of all vCPUs.
+    // Tracing is continuous when skip and warm are 0.
+    uint64_t   sample_skip;
+    uint64_t   sample_warm;
+    uint64_t   sample_detail;
+
+    // Translation-time trace filters, inclusive address ranges,
+    // one bit per exception level and instruction class
+    uint64_t   filter_va_lo;
+    uint64_t   filter_va_hi;
+    uint64_t   filter_pa_lo;
+    uint64_t   filter_pa_hi;
+    uint32_t   filter_el_mask;
+    enum { TRACE_CLASS_ALL, TRACE_CLASS_MEM, TRACE_CLASS_BRANCH, } filter_class;
+
+    // Trace file written by the file sink
+    char const *   trace_file;
+    uint32_t   trace_file_chunk;
+
+    // Consumers of the events in trace mode, TRACE_SINK_* bits
+    uint32_t   trace_sinks;
+
+    // Reuse distance profiler of trace-sink=reuse: output of the curves,
+    // 1 in `reuse_rate' lines or pages sampled, at most `reuse_entries'
+    // tracked, curves every `reuse_interval' instructions of a vCPU
+    char const *   reuse_file;
+    uint32_t   reuse_rate;
+    uint32_t   reuse_entries;
+    uint64_t   reuse_interval;
+
+    // Basic block vectors for SimPoint, `<bbv_file>.<vcpu>.bb', one vector
+    // every `bbv_interval' instructions of a vCPU
+    char const *   bbv_file;
+    uint64_t   bbv_interval;
+
+    // Sharing detector of trace-sink=sharing: at most `sharing_lines'
+    // physical lines tracked, the `sharing_top' most contended reported
+    uint32_t   sharing_lines;
+    uint32_t   sharing_top;
+
+    // Lock contention profiler of trace-sink=lock, the `lock_top' most
+    // contended lock lines and instructions reported
+    uint32_t   lock_top;
+
+    // Log every traced instruction with its disassembly, made lazily
+    bool       trace_disas;
+
+    // Hold the fetch event of each branch until its target is known,
+    // and send it with `target_address' set
+    bool       trace_branch;
+
+    // Static instruction dictionary file, NULL for none
+    char const *   insn_dict;
+
+    // Encoding of the events in the trace file and the rings
+    enum { TRACE_ENCODING_RAW, TRACE_ENCODING_COMPACT, } trace_encoding;
+
+    // Deterministic merge of the events of every vCPU before Flexus,
+    // by quanta of `order_quantum' instructions. Replaces the rings.
+    bool       trace_order;
+    uint64_t   order_quantum;
+
+    // Per-vCPU trace rings, 0 entries means synchronous calls to Flexus
+    uint32_t   ring_size;
+    uint32_t   ring_consumers;
+
     enum { MODE_TRACE, MODE_TIMING, } mode;
 
+    // QEMU <-> Flexus interface version negotiated at load time
+    uint32_t   api_version;
+
 };
 
 /**
@@ -0,0 +1,270 @@
+/*
+ * Latency histograms of the QEMU <-> Flexus boundary.
+ *
+ * Calls are timed with the host tick counter (TSC on x86) and filed in
+ * log2 buckets of ticks. Each call site has one histogram per vCPU plus one
+ * for the calls not tied to a vCPU (start, tick). A histogram is only ever
+ * updated by the thread calling for its vCPU at that time (vCPU thread,
+ * ring consumer or merge thread), so updates are plain stores.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+
+#include "qemu/qemu-plugin.h"
+
+#include "libqflex-legacy-api.h"
+#include "libqflex-module.h"
+#include "libqflex-prof.h"
+
+// Bucket k holds latencies in [2^(k-1), 2^k) ticks
+#define PROF_BUCKETS (48)
+
+typedef struct
+{
+    uint64_t calls;
+    uint64_t sampled;
+    uint64_t ticks;
+    uint64_t max;
+    uint64_t hist[PROF_BUCKETS];
+} __attribute__((aligned(64))) prof_hist_t;
+
+static char const * const site_name[LIBQFLEX_PROF_SITES] = {
+    [LIBQFLEX_PROF_TRACE_MEM] = "trace_mem",
+    [LIBQFLEX_PROF_START]     = "start",
+    [LIBQFLEX_PROF_CPU_EXEC]  = "cpu_exec",
+    [LIBQFLEX_PROF_TICK]      = "tick",
+};
+
+// [site][vCPU], the last slot for the calls without a vCPU
+static prof_hist_t* hists[LIBQFLEX_PROF_SITES];
+static size_t n_slots = 0;
+static uint32_t rate = 1;
+
+// Entries being wrapped
+static QEMU_API_t real_qemu;
+static FLEXUS_API_t real_flexus;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+static inline prof_hist_t*
+slot_of(libqflex_prof_site_t site, uint64_t vcpu_index)
+{
+    return &hists[site][MIN(vcpu_index, n_slots - 1)];
+}
+
+/**
+ * Count a call, true when it must be timed.
+ */
+static inline bool
+prof_sampled(prof_hist_t* h)
+{
+    return (h->calls++ % rate) == 0;
+}
+
+static inline void
+prof_record(prof_hist_t* h, int64_t t0)
+{
+    uint64_t const ticks = MAX(cpu_get_host_ticks() - t0, 0);
+
+    h->sampled++;
+    h->ticks += ticks;
+    h->max = MAX(h->max, ticks);
+    h->hist[ticks ? MIN(64 - clz64(ticks), PROF_BUCKETS - 1) : 0]++;
+}
+
+/**
+ * Upper bound in ticks of the bucket holding the `q' quantile.
+ */
+static uint64_t
+prof_quantile(prof_hist_t const * h, double q)
+{
+    uint64_t const rank = q * h->sampled;
+    uint64_t seen = 0;
+
+    for (size_t k = 0; k < PROF_BUCKETS; k++)
+    {
+        seen += h->hist[k];
+        if (seen > rank)
+            return 1ull << k;
+    }
+
+    return h->max;
+}
+
+// ─── Wrappers ────────────────────────────────────────────────────────────────
+
+static void
+prof_trace_mem(uint64_t vcpu_index, memory_transaction_t* tr)
+{
+    prof_hist_t* h = slot_of(LIBQFLEX_PROF_TRACE_MEM, vcpu_index);
+
+    if (!prof_sampled(h))
+    {
+        real_flexus.trace_mem(vcpu_index, tr);
+        return;
+    }
+
+    int64_t const t0 = cpu_get_host_ticks();
+    real_flexus.trace_mem(vcpu_index, tr);
+    prof_record(h, t0);
+}
+
+static void
+prof_trace_mem_batch(uint64_t vcpu_index, memory_transaction_t* tr, size_t n)
+{
+    prof_hist_t* h = slot_of(LIBQFLEX_PROF_TRACE_MEM, vcpu_index);
+
+    if (!prof_sampled(h))
+    {
+        real_flexus.trace_mem_batch(vcpu_index, tr, n);
+        return;
+    }
+
+    int64_t const t0 = cpu_get_host_ticks();
+    real_flexus.trace_mem_batch(vcpu_index, tr, n);
+    prof_record(h, t0);
+}
+
+static void
+prof_trace_mem_ordered(uint64_t vcpu_index, memory_transaction_t* tr, trace_stamp_t const * stamps, size_t n)
+{
+    prof_hist_t* h = slot_of(LIBQFLEX_PROF_TRACE_MEM, vcpu_index);
+
+    if (!prof_sampled(h))
+    {
+        real_flexus.trace_mem_ordered(vcpu_index, tr, stamps, n);
+        return;
+    }
+
+    int64_t const t0 = cpu_get_host_ticks();
+    real_flexus.trace_mem_ordered(vcpu_index, tr, stamps, n);
+    prof_record(h, t0);
+}
+
+static void
+prof_start(uint64_t cycles)
+{
+    prof_hist_t* h = slot_of(LIBQFLEX_PROF_START, UINT64_MAX);
+
+    // Runs the whole simulation, always timed
+    h->calls++;
+
+    int64_t const t0 = cpu_get_host_ticks();
+    real_flexus.start(cycles);
+    prof_record(h, t0);
+}
+
+static uint64_t
+prof_cpu_exec(size_t core_index, bool count)
+{
+    prof_hist_t* h = slot_of(LIBQFLEX_PROF_CPU_EXEC, core_index);
+
+    if (!prof_sampled(h))
+        return real_qemu.cpu_exec(core_index, count);
+
+    int64_t const t0 = cpu_get_host_ticks();
+    uint64_t const ret = real_qemu.cpu_exec(core_index, count);
+    prof_record(h, t0);
+
+    return ret;
+}
+
+static void
+prof_tick(void)
+{
+    prof_hist_t* h = slot_of(LIBQFLEX_PROF_TICK, UINT64_MAX);
+
+    if (!prof_sampled(h))
+    {
+        real_qemu.tick();
+        return;
+    }
+
+    int64_t const t0 = cpu_get_host_ticks();
+    real_qemu.tick();
+    prof_record(h, t0);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+libqflex_prof_init(size_t n_vcpus, uint32_t sample_rate)
+{
+    n_slots = n_vcpus + 1;
+    rate = MAX(sample_rate, 1);
+
+    for (size_t s = 0; s < LIBQFLEX_PROF_SITES; s++)
+        hists[s] = g_new0(prof_hist_t, n_slots);
+}
+
+void
+libqflex_prof_wrap_qemu(QEMU_API_t* api)
+{
+    real_qemu = *api;
+
+    if (api->cpu_exec)  api->cpu_exec = prof_cpu_exec;
+    if (api->tick)      api->tick     = prof_tick;
+}
+
+void
+libqflex_prof_wrap_flexus(FLEXUS_API_t* api)
+{
+    real_flexus = *api;
+
+    if (api->trace_mem)         api->trace_mem         = prof_trace_mem;
+    if (api->trace_mem_batch)   api->trace_mem_batch   = prof_trace_mem_batch;
+    if (api->trace_mem_ordered) api->trace_mem_ordered = prof_trace_mem_ordered;
+    if (api->start)             api->start             = prof_start;
+}
+
+void
+libqflex_prof_dump(GString* out)
+{
+    if (n_slots == 0)
+        return;
+
+    for (size_t s = 0; s < LIBQFLEX_PROF_SITES; s++)
+        for (size_t i = 0; i < n_slots; i++)
+        {
+            prof_hist_t const * h = &hists[s][i];
+
+            if (!h->sampled)
+                continue;
+
+            if (i == n_slots - 1)
+                g_string_append_printf(out, "> PROF[%s]", site_name[s]);
+            else
+                g_string_append_printf(out, "> PROF[%s] VCPU[%zu]", site_name[s], i);
+
+            g_string_append_printf(out, " CALLS: %" PRIu64 " SAMPLED: %" PRIu64
+                                        " MEAN: %" PRIu64 " P50: %" PRIu64 " P99: %" PRIu64
+                                        " MAX: %" PRIu64 " EST_TOTAL: %" PRIu64 " HIST:",
+                                   h->calls, h->sampled, h->ticks / h->sampled,
+                                   prof_quantile(h, .5), prof_quantile(h, .99), h->max,
+                                   h->ticks / h->sampled * h->calls);
+
+            for (size_t k = 0; k < PROF_BUCKETS; k++)
+                if (h->hist[k])
+                    g_string_append_printf(out, " %zu:%" PRIu64, k, h->hist[k]);
+
+            g_string_append_c(out, '\n');
+        }
+
+    g_string_append(out, "> PROF in host ticks, bucket k holds [2^(k-1), 2^k)\n");
+}
+
+void
+libqflex_prof_report(void)
+{
+    g_autoptr(GString) report = g_string_new("");
+
+    libqflex_prof_dump(report);
+
+    if (report->len)
+        qemu_plugin_outs(report->str);
+}
@@ -0,0 +1,47 @@
+#ifndef LIBQFLEX_PROF_H
+#define LIBQFLEX_PROF_H
+
+#include "libqflex-legacy-api.h"
+
+/**
+ * Latency histograms of the calls crossing the QEMU <-> Flexus boundary,
+ * enabled with -libqflex prof=on.
+ *
+ * The QEMU_API_t and FLEXUS_API_t entries below are swapped for timing
+ * wrappers when the interface is set up, so every call site is covered and
+ * nothing at all is paid without prof=on. With prof-rate=N only one call in
+ * N of a vCPU is timed, the others are only counted.
+ */
+typedef enum {
+    LIBQFLEX_PROF_TRACE_MEM,    // trace_mem, trace_mem_batch, trace_mem_ordered
+    LIBQFLEX_PROF_START,
+    LIBQFLEX_PROF_CPU_EXEC,
+    LIBQFLEX_PROF_TICK,
+    LIBQFLEX_PROF_SITES,
+} libqflex_prof_site_t;
+
+void
+libqflex_prof_init(size_t n_vcpus, uint32_t rate);
+
+/**
+ * Swap the entries QEMU exposes to Flexus, before handing them over.
+ */
+void
+libqflex_prof_wrap_qemu(QEMU_API_t* api);
+
+/**
+ * Swap the entries Flexus exposes to QEMU, once it filled them.
+ */
+void
+libqflex_prof_wrap_flexus(FLEXUS_API_t* api);
+
+/**
+ * Append the histograms, one line per call site and vCPU.
+ */
+void
+libqflex_prof_dump(GString* out);
+
+void
+libqflex_prof_report(void);
+
+#endif
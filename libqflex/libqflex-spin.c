@@ -0,0 +1,431 @@
+/*
+ * Spin loop detection and fast-forward of the timing mode.
+ *
+ * Every instruction Flexus steps goes through libqflex_spin_observe() first.
+ * A backward jump of at most SPIN_MAX_INSNS instructions closes a turn of a
+ * loop. The loop body is decoded once: it must not store, except for store
+ * exclusives which leave it when they succeed, and its loads must be either
+ * base register or unsigned immediate forms, whose address is taken from
+ * the registers right before they execute, and hit guest RAM.
+ *
+ * When the general registers and flags at the loop head are the same turn
+ * after turn, the loop computes nothing and only depends on the words it
+ * loads. It is then parked and skipped as a whole: the vCPU looks idle to
+ * Flexus, as if it was in WFI, and is woken up when a loaded word changes
+ * (another vCPU stored to it), an interrupt is pending, or after
+ * `spin-max-park' cycles, which bounds what cannot be seen (SEV, a store
+ * of the same value, timer reads). Those are checked when Flexus advances
+ * the vCPU, is_busy() only reads whether it is parked.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "exec/address-spaces.h"
+#include "exec/cpu-common.h"
+#include "exec/memory.h"
+#include "qemu/rcu.h"
+#include "sysemu/cpu-timers.h"
+#include "include/sysemu/cpu-timers-internal.h"
+
+#include "qemu/qemu-plugin.h"
+
+#include "libqflex.h"
+#include "libqflex-module.h"
+#include "libqflex-spin.h"
+#include "plugins/trace/trace.h"
+
+// Longest loop body followed, in instructions
+#define SPIN_MAX_INSNS (16)
+
+#define OPCODE_WFE   (0xd503205f)
+#define OPCODE_YIELD (0xd503203f)
+
+typedef enum {
+    SPIN_WAKE_STORE,
+    SPIN_WAKE_IRQ,
+    SPIN_WAKE_TIMEOUT,
+    SPIN_WAKE_REASONS,
+} spin_wake_t;
+
+static char const * const wake_name[SPIN_WAKE_REASONS] = {
+    [SPIN_WAKE_STORE]   = "store",
+    [SPIN_WAKE_IRQ]     = "irq",
+    [SPIN_WAKE_TIMEOUT] = "timeout",
+};
+
+typedef struct
+{
+    bool        is_load;
+    uint8_t     rn;
+    uint8_t     size;       // log2 of the bytes loaded
+    uint32_t    offset;     // added to Xn
+} spin_insn_t;
+
+typedef struct
+{
+    logical_address_t   va;
+    physical_address_t  pa;
+    uint64_t            value;
+} spin_watch_t;
+
+typedef struct
+{
+    logical_address_t   prev_pc;
+
+    // Loop followed, [lo, hi]. hi is 0 when none
+    logical_address_t   lo;
+    logical_address_t   hi;
+    bool                decoded;
+    bool                eligible;
+    spin_insn_t         body[SPIN_MAX_INSNS];
+    uint32_t            loads;      // bit per load of the body
+    uint32_t            seen;       // loads executed during this turn
+
+    // Turns with the same registers at the loop head, since `since_*'
+    uint32_t            turns;
+    uint64_t            regs[32];
+    uint32_t            flags[4];
+    uint64_t            since_cycle;
+    uint64_t            since_insns;
+
+    spin_watch_t        watch[SPIN_MAX_INSNS];
+
+    // Parked, with the rate of the loop measured before
+    bool                parked;
+    uint64_t            park_cycle;
+    uint64_t            rate_cycles;
+    uint64_t            rate_insns;
+
+    uint64_t            parks;
+    uint64_t            unparkable;
+    uint64_t            wakes[SPIN_WAKE_REASONS];
+    uint64_t            skipped_insns;
+    uint64_t            skipped_cycles;
+
+} spin_vcpu_t;
+
+static spin_vcpu_t* spins = NULL;
+static size_t n_spins = 0;
+static uint32_t threshold = 64;
+static uint64_t max_park = 0;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+/**
+ * Simulated cycles, advanced by libqflex_tick().
+ */
+static inline uint64_t
+spin_now(void)
+{
+    return qatomic_read_i64(&timers_state.qemu_icount);
+}
+
+static void
+spin_forget(spin_vcpu_t* s)
+{
+    s->lo = s->hi = 0;
+    s->turns = 0;
+    s->seen = 0;
+}
+
+/**
+ * Decode the body of the loop, true when it can be parked.
+ */
+static bool
+spin_decode(spin_vcpu_t* s, vCPU_t* vcpu)
+{
+    size_t const n = (s->hi - s->lo) / 4 + 1;
+    uint32_t opcodes[SPIN_MAX_INSNS];
+
+    if (cpu_memory_rw_debug(vcpu->state, s->lo, opcodes, n * 4, false))
+        return false;
+
+    s->loads = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t const op = opcodes[i];
+        struct mem_access m;
+
+        s->body[i] = (spin_insn_t) { .is_load = false };
+
+        if (op == OPCODE_WFE || op == OPCODE_YIELD || !decode_armv8_mem_opcode(&m, op))
+            continue;
+
+        if (m.is_store)
+        {
+            if (decode_armv8_excl_opcode(op) != TRACE_EXCL_STORE)
+                return false;
+            continue;
+        }
+
+        // LDXR, LDAXR, LDAR: [Xn]
+        if (extract32(op, 24, 6) == 0x08)
+            s->body[i] = (spin_insn_t) {
+                .is_load = true,
+                .rn      = extract32(op, 5, 5),
+                .size    = MIN(m.size, 3),
+            };
+        // LDR (unsigned immediate), general registers: [Xn, #imm12 << size]
+        else if (extract32(op, 24, 6) == 0x39 && !extract32(op, 26, 1))
+            s->body[i] = (spin_insn_t) {
+                .is_load = true,
+                .rn      = extract32(op, 5, 5),
+                .size    = MIN(m.size, 3),
+                .offset  = extract32(op, 10, 12) << extract32(op, 30, 2),
+            };
+        else
+            return false;
+
+        s->loads |= 1u << i;
+    }
+
+    return true;
+}
+
+/**
+ * True when the `size' bytes at `pa' are guest RAM, which can be read
+ * without side effects, unlike device registers.
+ */
+static bool
+spin_is_ram(physical_address_t pa, size_t size)
+{
+    hwaddr xlat;
+    hwaddr len = size;
+
+    RCU_READ_LOCK_GUARD();
+
+    MemoryRegion* mr = address_space_translate(&address_space_memory, pa, &xlat, &len,
+                                               false, MEMTXATTRS_UNSPECIFIED);
+
+    return memory_region_is_ram(mr) && len >= size;
+}
+
+static void
+spin_park(spin_vcpu_t* s, vCPU_t* vcpu)
+{
+    for (size_t i = 0; i < SPIN_MAX_INSNS; i++)
+    {
+        if (!(s->loads & (1u << i)))
+            continue;
+
+        spin_watch_t* w = &s->watch[i];
+        physical_address_t const page = libqflex_translate_va2pa(vcpu->index, w->va);
+        size_t const size = 1 << s->body[i].size;
+
+        w->pa = (page & TARGET_PAGE_MASK) | (w->va & ~TARGET_PAGE_MASK);
+
+        // Polling a device register, which is read again on every wake
+        // check, is left to the simulation
+        if (page == (physical_address_t) -1 || !spin_is_ram(w->pa, size))
+        {
+            s->unparkable++;
+            spin_forget(s);
+            return;
+        }
+
+        w->value = 0;
+        cpu_physical_memory_read(w->pa, &w->value, size);
+    }
+
+    uint64_t const now = spin_now();
+
+    s->parked      = true;
+    s->park_cycle  = now;
+    s->rate_cycles = now - s->since_cycle;
+    s->rate_insns  = vcpu->n_insns - s->since_insns;
+    s->parks++;
+}
+
+static void
+spin_wake(spin_vcpu_t* s, vCPU_t* vcpu, spin_wake_t reason)
+{
+    uint64_t const cycles = spin_now() - s->park_cycle;
+    // As many instructions as the loop would have run meanwhile
+    uint64_t const insns = cycles * s->rate_insns / MAX(s->rate_cycles, 1);
+
+    vcpu->n_insns     += insns;
+    s->skipped_insns  += insns;
+    s->skipped_cycles += cycles;
+    s->wakes[reason]++;
+
+    s->parked = false;
+    spin_forget(s);
+
+    if (qemu_libqflex_state.api_version >= 8)
+        flexus_api.spin_skip(vcpu->index, insns, cycles);
+}
+
+/**
+ * Loop head reached from `s->prev_pc'.
+ */
+static void
+spin_turn(spin_vcpu_t* s, vCPU_t* vcpu, logical_address_t pc)
+{
+    CPUArchState const * env = vcpu->env;
+    uint32_t const flags[4] = { env->NF, env->ZF, env->CF, env->VF };
+
+    bool const same_loop = (s->hi && pc == s->lo && s->prev_pc == s->hi);
+
+    if (!same_loop)
+    {
+        s->lo = pc;
+        s->hi = s->prev_pc;
+        s->decoded = false;
+    }
+    else if (!s->decoded)
+    {
+        s->eligible = spin_decode(s, vcpu);
+        s->decoded = true;
+    }
+
+    bool const stable =
+        same_loop && s->eligible && s->seen == s->loads &&
+        memcmp(s->regs, env->xregs, sizeof(s->regs)) == 0 &&
+        memcmp(s->flags, flags, sizeof(flags)) == 0;
+
+    s->seen = 0;
+
+    if (!stable)
+    {
+        memcpy(s->regs, env->xregs, sizeof(s->regs));
+        memcpy(s->flags, flags, sizeof(flags));
+        s->turns = 0;
+        s->since_cycle = spin_now();
+        s->since_insns = vcpu->n_insns;
+        return;
+    }
+
+    if (++s->turns >= threshold)
+        spin_park(s, vcpu);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+libqflex_spin_init(size_t n_vcpus, uint32_t turns, uint64_t max_cycles)
+{
+    n_spins = n_vcpus;
+    threshold = MAX(turns, 1);
+    max_park = max_cycles;
+    spins = g_new0(spin_vcpu_t, n_spins);
+}
+
+void
+libqflex_spin_observe(vCPU_t* vcpu)
+{
+    spin_vcpu_t* s = &spins[vcpu->index];
+    logical_address_t const pc = vcpu->env->pc;
+
+    if (!is_a64(vcpu->env))
+    {
+        spin_forget(s);
+        s->prev_pc = pc;
+        return;
+    }
+
+    if (pc <= s->prev_pc && s->prev_pc - pc < SPIN_MAX_INSNS * 4)
+        spin_turn(s, vcpu, pc);
+    else if (s->hi && (pc < s->lo || pc > s->hi))
+        spin_forget(s);
+
+    // Address of a load of the loop, right before it executes
+    if (s->hi && s->decoded && s->eligible)
+    {
+        size_t const i = (pc - s->lo) / 4;
+
+        if (s->loads & (1u << i))
+        {
+            spin_insn_t const * insn = &s->body[i];
+
+            s->watch[i].va = vcpu->env->xregs[insn->rn] + insn->offset;
+            s->seen |= 1u << i;
+        }
+    }
+
+    s->prev_pc = pc;
+}
+
+bool
+libqflex_spin_parked(vCPU_t* vcpu)
+{
+    return spins[vcpu->index].parked;
+}
+
+bool
+libqflex_spin_check(vCPU_t* vcpu)
+{
+    spin_vcpu_t* s = &spins[vcpu->index];
+
+    if (!s->parked)
+        return false;
+
+    if (libqflex_has_interrupt(vcpu->index))
+    {
+        spin_wake(s, vcpu, SPIN_WAKE_IRQ);
+        return false;
+    }
+
+    if (max_park && spin_now() - s->park_cycle >= max_park)
+    {
+        spin_wake(s, vcpu, SPIN_WAKE_TIMEOUT);
+        return false;
+    }
+
+    // Watched words are RAM, see spin_park()
+    for (size_t i = 0; i < SPIN_MAX_INSNS; i++)
+    {
+        if (!(s->loads & (1u << i)))
+            continue;
+
+        uint64_t value = 0;
+        cpu_physical_memory_read(s->watch[i].pa, &value, 1 << s->body[i].size);
+
+        if (value != s->watch[i].value)
+        {
+            spin_wake(s, vcpu, SPIN_WAKE_STORE);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+libqflex_spin_dump(GString* out)
+{
+    for (size_t i = 0; i < n_spins; i++)
+    {
+        spin_vcpu_t const * s = &spins[i];
+
+        if (!s->parks && !s->unparkable)
+            continue;
+
+        g_string_append_printf(out,
+            "> SPIN CPU[%zu] PARKS: %" PRIu64 " UNPARKABLE: %" PRIu64
+            " SKIPPED_INSNS: %" PRIu64 " SKIPPED_CYCLES: %" PRIu64 " WAKES:",
+            i, s->parks, s->unparkable, s->skipped_insns, s->skipped_cycles);
+
+        for (size_t r = 0; r < SPIN_WAKE_REASONS; r++)
+            g_string_append_printf(out, " %s:%" PRIu64, wake_name[r], s->wakes[r]);
+
+        g_string_append_printf(out, "%s\n", s->parked ? " (parked)" : "");
+    }
+}
+
+void
+libqflex_spin_report(void)
+{
+    if (spins == NULL)
+        return;
+
+    g_autoptr(GString) report = g_string_new("");
+
+    libqflex_spin_dump(report);
+
+    if (report->len)
+        qemu_plugin_outs(report->str);
+}
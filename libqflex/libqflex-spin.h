@@ -0,0 +1,46 @@
+#ifndef LIBQFLEX_SPIN_H
+#define LIBQFLEX_SPIN_H
+
+#include "libqflex.h"
+
+/**
+ * Spin loop fast-forward of the timing mode, enabled with -libqflex spin=on.
+ *
+ * A vCPU going around the same short loop, without storing and with the
+ * same registers at every turn, only waits on the memory its loop loads.
+ * After `spin-threshold' such turns it is parked: reported idle through
+ * is_busy() and not stepped anymore, until one of the loaded words changes,
+ * an interrupt is pending or `spin-max-park' cycles went by. On wake-up the
+ * turns it would have made are credited to its instruction count and handed
+ * to Flexus through spin_skip() (API version 8).
+ */
+void
+libqflex_spin_init(size_t n_vcpus, uint32_t threshold, uint64_t max_park);
+
+/**
+ * Follow the instruction a vCPU is about to execute, from libqflex_advance().
+ */
+void
+libqflex_spin_observe(vCPU_t* vcpu);
+
+/**
+ * True while a vCPU is parked on a spin loop. Only reads the state, is_busy()
+ * queries must not move it.
+ */
+bool
+libqflex_spin_parked(vCPU_t* vcpu);
+
+/**
+ * True while a vCPU stays parked, from libqflex_advance(). Wakes it up, and
+ * returns false, when its loop would exit.
+ */
+bool
+libqflex_spin_check(vCPU_t* vcpu);
+
+void
+libqflex_spin_dump(GString* out);
+
+void
+libqflex_spin_report(void);
+
+#endif
@@ -14,6 +14,8 @@
 #include "libqflex.h"
 #include "libqflex-module.h"
 #include "libqflex-legacy-api.h"
+#include "libqflex-spin.h"
+#include "plugins/trace/trace.h"
 
 #include "target/arm/cpregs.h" // Need to be last
 // ─────────────────────────────────────────────────────────────────────────────
@@ -238,6 +240,11 @@ bool
 libqflex_is_core_busy(size_t cpu_index)
 {
     vCPU_t* cpu_wrapper = lookup_vcpu(cpu_index);
+
+    // A vCPU parked on a spin loop idles like a halted one
+    if (qemu_libqflex_state.spin && libqflex_spin_parked(cpu_wrapper))
+        return false;
+
     return !cpu_wrapper->state->halted;
 }
 
@@ -273,6 +280,16 @@ libqflex_has_interrupt(size_t cpu_index)
                 cpu_wrapper->state->interrupt_request);
 }
 
+uint64_t
+libqflex_get_instruction_count(size_t cpu_index)
+{
+    vCPU_t* cpu_wrapper = lookup_vcpu(cpu_index);
+
+    if (qemu_libqflex_state.mode == MODE_TIMING)
+        return cpu_wrapper->n_insns;
+
+    return trace_count_get_insns(cpu_index);
+}
 
 void
 libqflex_tick(void)
@@ -295,8 +312,17 @@ uint64_t
 libqflex_advance(size_t cpu_index, bool trigger_count)
 {
     vCPU_t* cpu_wrapper = lookup_vcpu(cpu_index);
+
+    // Nothing to execute until the spin loop would exit
+    if (qemu_libqflex_state.spin && libqflex_spin_check(cpu_wrapper))
+        return EXCP_QFLEX_IDLE;
+
     if (trigger_count) qemu_libqflex_state.cycles--;
 
+    if (qemu_libqflex_state.spin)
+        libqflex_spin_observe(cpu_wrapper);
+
+    cpu_wrapper->n_insns++;
     return libqflex_step(cpu_wrapper->state);
 }
 
@@ -312,6 +338,9 @@ libqflex_stop(char const * const msg)
     Error* err = NULL;
     qemu_log("> [Libqflex] Stopping: %s\n", msg);
 
+    if (qemu_libqflex_state.spin)
+        libqflex_spin_report();
+
     qmp_stop(&err);
 
 //    if (qemu_libqflex_state.is_running) {
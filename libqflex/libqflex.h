@@ -40,6 +40,9 @@ typedef struct
     // eg: generic register, pc, pstate, spsr, cpsr, ...
     CPUArchState* env;
 
+    // Instructions stepped through libqflex_advance() (timing mode)
+    uint64_t n_insns;
+
     // -*- Whatever is needed -*-
 } vCPU_t;
 
@@ -122,6 +125,18 @@ libqflex_get_pc(size_t);
  */
 bool
 libqflex_has_interrupt(size_t cpu_index);
+
+/**
+ * Return the number of instructions a core has executed, counted by the
+ * trace plugin inline counters in trace mode, and by libqflex_advance()
+ * in timing mode.
+ *
+ * @param size_t Virtual CPU Index
+ *
+ * @return a 64bits counter
+ */
+uint64_t
+libqflex_get_instruction_count(size_t cpu_index);
 /**
  * USED IN FLEXUS
  *
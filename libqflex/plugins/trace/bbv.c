@@ -0,0 +1,237 @@
+/*
+ * Basic block vectors of the trace plugin, for SimPoint (-libqflex bbv-file).
+ *
+ * Blocks are numbered by their start PC the first time they are translated,
+ * from 1 as SimPoint expects, and keep their number over retranslations and
+ * TB flushes. Every block adds its instruction count to its own per-vCPU
+ * counter with an inline operation, so that a vector costs no helper call;
+ * counters live in scoreboards of BBV_CHUNK_BLOCKS blocks, added as blocks
+ * show up.
+ *
+ * Like the sampling schedule, each vCPU counts its instructions inline and
+ * a conditional callback closes its interval once `bbv-interval' of them
+ * went by: the non-zero counters are written as one line of
+ * `<bbv-file>.<vcpu>.bb' and cleared. The last, partial, interval is
+ * written at exit along with `<bbv-file>.pc', the start PC of every block.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/log.h"
+
+#include "qemu/qemu-plugin.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "trace.h"
+
+// Blocks per counter scoreboard
+#define BBV_CHUNK_BLOCKS (4096)
+
+typedef struct
+{
+    // Start PC, first for g_int64_hash
+    logical_address_t   pc;
+    uint32_t            id;
+} bbv_block_t;
+
+typedef struct
+{
+    FILE*       file;
+    uint64_t    intervals;
+} bbv_vcpu_t;
+
+static bbv_vcpu_t* vcpus = NULL;
+static size_t n_vcpus = 0;
+static char* prefix = NULL;
+static uint64_t interval_len = 0;
+
+// Block numbers by start PC, and their counters
+static GMutex lock;
+static GHashTable* ids = NULL;
+static GPtrArray* blocks = NULL;
+static GPtrArray* chunks = NULL;
+
+static struct qemu_plugin_scoreboard* since = NULL;
+static qemu_plugin_u64 since_insns;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+/**
+ * Counter of block `id'. The lock must be held.
+ */
+static inline qemu_plugin_u64
+counter_of(uint32_t id)
+{
+    return (qemu_plugin_u64) {
+        .score  = g_ptr_array_index(chunks, (id - 1) / BBV_CHUNK_BLOCKS),
+        .offset = ((id - 1) % BBV_CHUNK_BLOCKS) * sizeof(uint64_t),
+    };
+}
+
+/**
+ * Number of the block at `pc', given one when new. The lock must be held.
+ */
+static uint32_t
+block_id(logical_address_t pc)
+{
+    bbv_block_t* block = g_hash_table_lookup(ids, &pc);
+
+    if (block)
+        return block->id;
+
+    block = g_new(bbv_block_t, 1);
+    block->pc = pc;
+    g_ptr_array_add(blocks, block);
+    block->id = blocks->len;
+
+    if (chunks->len * BBV_CHUNK_BLOCKS < block->id)
+        g_ptr_array_add(chunks, qemu_plugin_scoreboard_new(BBV_CHUNK_BLOCKS * sizeof(uint64_t)));
+
+    g_hash_table_insert(ids, &block->pc, block);
+
+    return block->id;
+}
+
+/**
+ * Write the vector of the current interval of a vCPU and clear it.
+ */
+static void
+end_interval(unsigned int vcpu_index)
+{
+    bbv_vcpu_t* v = &vcpus[vcpu_index];
+    bool empty = true;
+
+    g_mutex_lock(&lock);
+
+    for (uint32_t id = 1; id <= blocks->len; id++)
+    {
+        qemu_plugin_u64 const c = counter_of(id);
+        uint64_t const n = qemu_plugin_u64_get(c, vcpu_index);
+
+        if (n == 0)
+            continue;
+
+        fprintf(v->file, "%s:%u:%" PRIu64 " ", empty ? "T" : "", id, n);
+        qemu_plugin_u64_set(c, vcpu_index, 0);
+        empty = false;
+    }
+
+    g_mutex_unlock(&lock);
+
+    if (!empty)
+    {
+        fputc('\n', v->file);
+        v->intervals++;
+    }
+}
+
+/**
+ * Called when a vCPU went through an interval of instructions.
+ */
+static void
+dispatch_interval(unsigned int vcpu_index, void* userdata)
+{
+    qemu_plugin_u64_set(since_insns, vcpu_index, 0);
+    end_interval(vcpu_index);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_bbv_init(size_t nb_vcpus, char const * path, uint64_t interval)
+{
+    n_vcpus      = nb_vcpus;
+    prefix       = g_strdup(path);
+    interval_len = interval;
+
+    vcpus = g_new0(bbv_vcpu_t, n_vcpus);
+
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        g_autofree char* name = g_strdup_printf("%s.%zu.bb", prefix, i);
+
+        if ((vcpus[i].file = fopen(name, "w")) == NULL)
+        {
+            error_report("ERROR: cannot create bbv-file %s: %s", name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    g_mutex_init(&lock);
+    ids    = g_hash_table_new(g_int64_hash, g_int64_equal);
+    blocks = g_ptr_array_new_with_free_func(g_free);
+    chunks = g_ptr_array_new();
+
+    since = qemu_plugin_scoreboard_new(sizeof(uint64_t));
+    since_insns = qemu_plugin_scoreboard_u64(since);
+
+    qemu_log("> [Libqflex] BBV          =%s.*.bb interval:%" PRIu64 "\n", prefix, interval_len);
+}
+
+void
+trace_bbv_register(struct qemu_plugin_tb* tb)
+{
+    if (vcpus == NULL)
+        return;
+
+    size_t const n_insns = qemu_plugin_tb_n_insns(tb);
+
+    g_mutex_lock(&lock);
+    qemu_plugin_u64 const counter = counter_of(block_id(qemu_plugin_tb_vaddr(tb)));
+    g_mutex_unlock(&lock);
+
+    qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+        tb, QEMU_PLUGIN_INLINE_ADD_U64, counter, n_insns);
+
+    qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+        tb, QEMU_PLUGIN_INLINE_ADD_U64, since_insns, n_insns);
+
+    qemu_plugin_register_vcpu_tb_exec_cond_cb(
+        tb, dispatch_interval, QEMU_PLUGIN_CB_NO_REGS,
+        QEMU_PLUGIN_COND_GE, since_insns, interval_len, NULL);
+}
+
+void
+trace_bbv_exit(void)
+{
+    if (vcpus == NULL)
+        return;
+
+    g_autoptr(GString) report = g_string_new("");
+
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        end_interval(i);
+        fclose(vcpus[i].file);
+
+        g_string_append_printf(report, "> BBV CPU[%zu] INTERVALS: %" PRIu64 "\n", i, vcpus[i].intervals);
+    }
+
+    g_autofree char* name = g_strdup_printf("%s.pc", prefix);
+    FILE* file = fopen(name, "w");
+
+    if (file)
+    {
+        for (uint32_t i = 0; i < blocks->len; i++)
+        {
+            bbv_block_t const * block = g_ptr_array_index(blocks, i);
+            fprintf(file, "%u 0x%016" PRIx64 "\n", block->id, block->pc);
+        }
+        fclose(file);
+    }
+    else
+        error_report("ERROR: cannot create %s: %s", name, strerror(errno));
+
+    g_string_append_printf(report, "> BBV BLOCKS: %u\n", blocks->len);
+    qemu_plugin_outs(report->str);
+
+    // Counters stay, translated blocks still point at them
+    g_hash_table_destroy(ids);
+    g_ptr_array_free(blocks, true);
+    g_free(prefix);
+    g_free(vcpus);
+    vcpus = NULL;
+}
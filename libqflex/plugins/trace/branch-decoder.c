@@ -355,9 +355,24 @@ switch (extract32(opcode, 25, 4)) {
         // disas_data_proc_simd_fp(s, opcode);
         break;
     default:
-        assert(FALSE); /* all 15 cases should be handled above */
         break;
     }
 
     return false;
-}
\ No newline at end of file
+}
+
+bool
+decode_armv8_branch_offset(int32_t* offset, uint32_t opcode)
+{
+    if (extract32(opcode, 26, 5) == 0x05)           /* B, BL: imm26 */
+        *offset = sextract32(opcode, 0, 26) * 4;
+    else if (extract32(opcode, 25, 6) == 0x1a ||    /* CBZ, CBNZ: imm19 */
+             extract32(opcode, 24, 8) == 0x54)      /* B.cond, BC.cond: imm19 */
+        *offset = sextract32(opcode, 5, 19) * 4;
+    else if (extract32(opcode, 25, 6) == 0x1b)      /* TBZ, TBNZ: imm14 */
+        *offset = sextract32(opcode, 5, 14) * 4;
+    else
+        return false;
+
+    return true;
+}
@@ -0,0 +1,132 @@
+/*
+ * Branch outcomes and targets of the trace plugin (-libqflex trace-branch=on).
+ *
+ * The fetch event of a branch is held by its vCPU instead of being sent,
+ * and its `target_address' filled with the next PC the vCPU executes: QEMU
+ * ends a translated block after every branch, so that PC is the start of
+ * the next block, given to trace_branch_resolve() by a block callback
+ * before any event of that block. A conditional branch was taken when the
+ * target is not the fall-through.
+ *
+ * Targets are checked against what the branch can do: a direct branch can
+ * only reach its static target (decoded at translation) or fall through,
+ * and any instruction executed outside of the traced blocks in between
+ * (sampling, a TB flush) makes the target unknown. It is then left to 0.
+ * An interrupt taken right after an indirect branch goes unnoticed.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qemu/qemu-plugin.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "trace.h"
+
+typedef struct
+{
+    memory_transaction_t    pending;
+    bool                    has_pending;
+    logical_address_t       static_target;
+    // Instructions executed when the branch was held
+    uint64_t                insns;
+
+    uint64_t                conditional;
+    uint64_t                taken;
+    uint64_t                direct;
+    uint64_t                indirect;
+    uint64_t                unknown;
+
+} __attribute__((aligned(64))) branch_vcpu_t;
+
+static branch_vcpu_t* vcpus = NULL;
+static size_t n_vcpus = 0;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_branch_init(size_t n)
+{
+    n_vcpus = n;
+    vcpus = g_new0(branch_vcpu_t, n_vcpus);
+}
+
+void
+trace_branch_defer(unsigned int vcpu_index, memory_transaction_t const * tr, trace_insn_t const * insn)
+{
+    branch_vcpu_t* v = &vcpus[vcpu_index];
+
+    // Its block was left before reaching the next one (exception)
+    if (v->has_pending)
+        trace_branch_resolve(vcpu_index, 0);
+
+    v->pending       = *tr;
+    v->has_pending   = true;
+    v->insns         = trace_count_get_insns(vcpu_index);
+    v->static_target = (insn->branch_offset == TRACE_BRANCH_INDIRECT) ? 0 :
+                       insn->target_pc_va + insn->branch_offset;
+}
+
+void
+trace_branch_resolve(unsigned int vcpu_index, logical_address_t next_pc)
+{
+    branch_vcpu_t* v = &vcpus[vcpu_index];
+
+    if (!v->has_pending)
+        return;
+
+    generic_transaction_t* s = &v->pending.s;
+    logical_address_t const fall = s->pc + s->size;
+
+    // The instruction counter may or may not include the branch yet
+    bool known = next_pc && (trace_count_get_insns(vcpu_index) - v->insns <= 1);
+
+    if (v->static_target)
+    {
+        known = known && (next_pc == v->static_target || next_pc == fall);
+        v->direct++;
+    }
+    else
+        v->indirect++;
+
+    s->target_address = known ? next_pc : 0;
+
+    if (!known)
+        v->unknown++;
+    else if (s->branch_type == QEMU_Conditional_Branch)
+    {
+        v->conditional++;
+        v->taken += (next_pc != fall);
+    }
+
+    v->has_pending = false;
+    trace_sink_emit(vcpu_index, &v->pending);
+}
+
+void
+trace_branch_exit(void)
+{
+    if (vcpus == NULL)
+        return;
+
+    g_autoptr(GString) report = g_string_new("");
+
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        branch_vcpu_t* v = &vcpus[i];
+
+        trace_branch_resolve(i, 0);
+
+        g_string_append_printf(report,
+            "> BRANCH CPU[%zu] DIRECT: %" PRIu64 " INDIRECT: %" PRIu64 " CONDITIONAL: %" PRIu64
+            " TAKEN: %" PRIu64 " UNKNOWN: %" PRIu64 "\n",
+            i, v->direct, v->indirect, v->conditional, v->taken, v->unknown);
+    }
+
+    qemu_plugin_outs(report->str);
+
+    g_free(vcpus);
+    vcpus = NULL;
+}
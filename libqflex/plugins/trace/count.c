@@ -0,0 +1,219 @@
+/*
+ * Per-vCPU event counters of the trace plugin.
+ *
+ * Counters are QEMU plugin scoreboards updated by inline operations emitted
+ * in the translated code, no helper call is involved. The instruction counter
+ * is installed in every trace mode; trace-mode=count and stats=on also
+ * install the instruction mix counters (loads and stores per size, atomics,
+ * branches per type, exception levels). trace-mode=count installs nothing
+ * else, to fast-forward close to plain TCG speed.
+ *
+ * In trace-mode=count the instruction and exception level counters take one
+ * add per block rather than one per instruction. Other modes keep them
+ * exact at every instruction, the lock profiler and the branch trace read
+ * them in the middle of a block.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qemu/qemu-plugin.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "trace.h"
+
+static struct qemu_plugin_scoreboard* counts = NULL;
+
+static qemu_plugin_u64 insns;
+static qemu_plugin_u64 loads;
+static qemu_plugin_u64 stores;
+static qemu_plugin_u64 mem_insns;
+static qemu_plugin_u64 atomics;
+static qemu_plugin_u64 io;
+static qemu_plugin_u64 undecoded;
+
+// Instructions and exception levels counted once per block
+static bool per_block = false;
+
+static char const * const size_name[TRACE_COUNT_SIZES] = { "1", "2", "4", "8", "16+" };
+
+static inline qemu_plugin_u64
+entry_at(size_t offset, size_t index)
+{
+    return (qemu_plugin_u64) {
+        .score  = counts,
+        .offset = offset + index * sizeof(uint64_t),
+    };
+}
+
+/**
+ * Index of the per size counters of an access of 2^`size' bytes.
+ */
+static inline size_t
+size_index(uint8_t size)
+{
+    return MIN(size, TRACE_COUNT_SIZES - 1);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_count_init(bool count_per_block)
+{
+    per_block = count_per_block;
+    counts  = qemu_plugin_scoreboard_new(sizeof(trace_count_t));
+
+    insns     = qemu_plugin_scoreboard_u64_in_struct(counts, trace_count_t, insns);
+    loads     = qemu_plugin_scoreboard_u64_in_struct(counts, trace_count_t, loads);
+    stores    = qemu_plugin_scoreboard_u64_in_struct(counts, trace_count_t, stores);
+    mem_insns = qemu_plugin_scoreboard_u64_in_struct(counts, trace_count_t, mem_insns);
+    atomics   = qemu_plugin_scoreboard_u64_in_struct(counts, trace_count_t, atomics);
+    io        = qemu_plugin_scoreboard_u64_in_struct(counts, trace_count_t, io);
+    undecoded = qemu_plugin_scoreboard_u64_in_struct(counts, trace_count_t, undecoded);
+}
+
+void
+trace_count_register_tb(struct qemu_plugin_tb* tb, uint8_t exception_lvl, bool all)
+{
+    if (!per_block)
+        return;
+
+    size_t const n = qemu_plugin_tb_n_insns(tb);
+
+    qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+        tb, QEMU_PLUGIN_INLINE_ADD_U64, insns, n);
+
+    if (all)
+        qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+            tb, QEMU_PLUGIN_INLINE_ADD_U64,
+            entry_at(offsetof(trace_count_t, exception_lvl), exception_lvl & 3), n);
+}
+
+void
+trace_count_register(struct qemu_plugin_insn* insn, trace_insn_t const * rec, bool all)
+{
+    if (!per_block)
+        qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+            insn, QEMU_PLUGIN_INLINE_ADD_U64, insns, 1);
+
+    if (!all)
+        return;
+
+    if (!per_block)
+        qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+            insn, QEMU_PLUGIN_INLINE_ADD_U64,
+            entry_at(offsetof(trace_count_t, exception_lvl), rec->exception_lvl & 3), 1);
+
+    if (rec->has_mem_access)
+    {
+        size_t const s = size_index(rec->mem.size);
+
+        qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+            insn, QEMU_PLUGIN_INLINE_ADD_U64, mem_insns, 1);
+
+        qemu_plugin_register_vcpu_mem_inline_per_vcpu(
+            insn, QEMU_PLUGIN_MEM_R, QEMU_PLUGIN_INLINE_ADD_U64, loads, 1);
+        qemu_plugin_register_vcpu_mem_inline_per_vcpu(
+            insn, QEMU_PLUGIN_MEM_W, QEMU_PLUGIN_INLINE_ADD_U64, stores, 1);
+
+        qemu_plugin_register_vcpu_mem_inline_per_vcpu(
+            insn, QEMU_PLUGIN_MEM_R, QEMU_PLUGIN_INLINE_ADD_U64,
+            entry_at(offsetof(trace_count_t, loads_by_size), s), 1);
+        qemu_plugin_register_vcpu_mem_inline_per_vcpu(
+            insn, QEMU_PLUGIN_MEM_W, QEMU_PLUGIN_INLINE_ADD_U64,
+            entry_at(offsetof(trace_count_t, stores_by_size), s), 1);
+
+        if (rec->mem.is_atomic)
+            qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+                insn, QEMU_PLUGIN_INLINE_ADD_U64, atomics, 1);
+    }
+
+    if (rec->branch_type != QEMU_Non_Branch)
+        qemu_plugin_register_vcpu_insn_exec_inline_per_vcpu(
+            insn, QEMU_PLUGIN_INLINE_ADD_U64,
+            entry_at(offsetof(trace_count_t, branches), rec->branch_type), 1);
+}
+
+void
+trace_count_io(unsigned int vcpu_index)
+{
+    qemu_plugin_u64_add(io, vcpu_index, 1);
+}
+
+void
+trace_count_undecoded(unsigned int vcpu_index)
+{
+    qemu_plugin_u64_add(undecoded, vcpu_index, 1);
+}
+
+bool
+trace_count_get(size_t vcpu_index, trace_count_t* out)
+{
+    if (counts == NULL)
+        return false;
+
+    *out = *(trace_count_t*) qemu_plugin_scoreboard_find(counts, vcpu_index);
+    return true;
+}
+
+uint64_t
+trace_count_get_insns(size_t vcpu_index)
+{
+    return (counts == NULL) ? 0 : qemu_plugin_u64_get(insns, vcpu_index);
+}
+
+void
+trace_count_dump(GString* out, size_t n_vcpus, bool all)
+{
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        trace_count_t c;
+        if (!trace_count_get(i, &c))
+            return;
+
+        g_string_append_printf(out, "> VCPU[%zu] INSNS: %" PRIu64, i, c.insns);
+
+        if (all)
+        {
+            g_string_append_printf(out, " MEM_INSNS: %" PRIu64 " LOADS: %" PRIu64 " STORES: %" PRIu64
+                                        " ATOMICS: %" PRIu64,
+                                   c.mem_insns, c.loads, c.stores, c.atomics);
+
+            // No memory callback in trace-mode=count to see them
+            if (!per_block)
+                g_string_append_printf(out, " IO: %" PRIu64 " UNDECODED: %" PRIu64,
+                                       c.io, c.undecoded);
+
+            g_string_append(out, " LOADS_BY_SIZE:");
+            for (size_t s = 0; s < TRACE_COUNT_SIZES; s++)
+                g_string_append_printf(out, " %s:%" PRIu64, size_name[s], c.loads_by_size[s]);
+
+            g_string_append(out, " STORES_BY_SIZE:");
+            for (size_t s = 0; s < TRACE_COUNT_SIZES; s++)
+                g_string_append_printf(out, " %s:%" PRIu64, size_name[s], c.stores_by_size[s]);
+
+            g_string_append(out, " BRANCHES:");
+            for (size_t b = QEMU_Conditional_Branch; b < QEMU_BRANCH_TYPE_COUNT; b++)
+                g_string_append_printf(out, " %" PRIu64, c.branches[b]);
+
+            g_string_append(out, " EL:");
+            for (size_t el = 0; el < 4; el++)
+                g_string_append_printf(out, " %" PRIu64, c.exception_lvl[el]);
+        }
+
+        g_string_append(out, "\n");
+    }
+
+    g_string_append_printf(out, "> TOTAL_INSNS: %" PRIu64 "\n", qemu_plugin_u64_sum(insns));
+}
+
+void
+trace_count_report(size_t n_vcpus, bool all)
+{
+    g_autoptr(GString) report = g_string_new("");
+
+    trace_count_dump(report, n_vcpus, all);
+    qemu_plugin_outs(report->str);
+}
@@ -0,0 +1,190 @@
+/*
+ * Static instruction dictionary of the trace plugin.
+ *
+ * Translation records are thrown away on every TB flush, the dictionary
+ * outlives them so that an instruction keeps its ID for the whole run.
+ * It is only consulted when a record is created, never on execution, and is
+ * split in independently locked shards like the translation cache, so that
+ * vCPUs translating at the same time do not serialise on it.
+ *
+ * Entries are published to Flexus (API version 6) and appended to the
+ * dictionary file, see trace-format.h.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "middleware/libqflex/libqflex-module.h"
+#include "trace.h"
+#include "trace-format.h"
+
+typedef struct
+{
+    logical_address_t   pc;
+    physical_address_t  pa;
+    uint32_t            opcode;
+    uint32_t            exception_lvl;
+} dict_key_t;
+
+#define DICT_SHARDS_BITS    (6)
+#define DICT_SHARDS         (1 << DICT_SHARDS_BITS)
+
+typedef struct
+{
+    GMutex          lock;
+    // Protected by `lock'
+    GHashTable*     ids;
+
+} __attribute__((aligned(64))) dict_shard_t;
+
+static dict_shard_t shards[DICT_SHARDS];
+
+static uint32_t next_id = 1;
+// stdio locks the stream on every call, whole records go in one fwrite
+static FILE* file = NULL;
+
+static bool publish = false;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+static inline uint64_t
+dict_key_mix(dict_key_t const * k)
+{
+    uint64_t h = (k->pa ^ (k->pc << 16) ^ ((uint64_t)k->opcode << 32) ^ k->exception_lvl);
+    return h * 0x9E3779B97F4A7C15ull;
+}
+
+/**
+ * Pick a shard from the top bits of the key hash, the table of the shard
+ * uses the bits below them.
+ */
+static inline dict_shard_t*
+shard_of(dict_key_t const * k)
+{
+    return &shards[dict_key_mix(k) >> (64 - DICT_SHARDS_BITS)];
+}
+
+static guint
+dict_key_hash(gconstpointer p)
+{
+    return dict_key_mix(p) >> (32 - DICT_SHARDS_BITS);
+}
+
+static gboolean
+dict_key_equal(gconstpointer a, gconstpointer b)
+{
+    dict_key_t const * x = a;
+    dict_key_t const * y = b;
+
+    return x->pc == y->pc && x->pa == y->pa &&
+           x->opcode == y->opcode && x->exception_lvl == y->exception_lvl;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_dict_init(char const * path)
+{
+    for (size_t i = 0; i < DICT_SHARDS; i++)
+    {
+        g_mutex_init(&shards[i].lock);
+        shards[i].ids = g_hash_table_new_full(dict_key_hash, dict_key_equal, g_free, NULL);
+    }
+
+    publish = (qemu_libqflex_state.api_version >= 6);
+
+    if (!path)
+        return;
+
+    if ((file = fopen(path, "wb")) == NULL)
+    {
+        error_report("ERROR: cannot create insn-dict %s: %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    qflex_dict_header_t header = {
+        .format_version = QFLEX_DICT_FORMAT_VERSION,
+        .record_size    = sizeof(static_insn_t),
+    };
+    memcpy(header.magic, QFLEX_DICT_MAGIC, sizeof(header.magic));
+
+    fwrite(&header, sizeof(header), 1, file);
+}
+
+uint32_t
+trace_dict_id(trace_insn_t const * insn)
+{
+    dict_key_t key = {
+        .pc             = insn->target_pc_va,
+        .pa             = insn->target_pc_pa,
+        .opcode         = insn->opcode,
+        .exception_lvl  = insn->exception_lvl,
+    };
+
+    dict_shard_t* shard = shard_of(&key);
+
+    g_mutex_lock(&shard->lock);
+
+    uint32_t id = GPOINTER_TO_UINT(g_hash_table_lookup(shard->ids, &key));
+
+    if (id == 0)
+    {
+        id = qatomic_fetch_inc(&next_id);
+        g_hash_table_insert(shard->ids, g_memdup2(&key, sizeof(key)), GUINT_TO_POINTER(id));
+
+        static_insn_t entry = {
+            .id               = id,
+            .opcode           = insn->opcode,
+            .pc               = insn->target_pc_va,
+            .physical_address = insn->target_pc_pa,
+            .size             = insn->byte_size,
+            .exception        = insn->exception_lvl,
+            .branch_type      = insn->branch_type,
+            .mem_size         = insn->has_mem_access ? 1 << insn->mem.size : 0,
+            .is_load          = insn->has_mem_access && insn->mem.is_load,
+            .is_store         = insn->has_mem_access && insn->mem.is_store,
+            .is_atomic        = insn->has_mem_access && insn->mem.is_atomic,
+        };
+
+        // Still under the shard lock, another vCPU translating the same
+        // instruction waits here, so none can run it before. The merge thread
+        // publishes it before the first event it delivers after this with
+        // trace-order=on.
+        if (publish && !trace_order_static_insn(&entry))
+            flexus_api.static_insn(&entry);
+
+        if (file)
+            fwrite(&entry, sizeof(entry), 1, file);
+    }
+
+    g_mutex_unlock(&shard->lock);
+
+    return id;
+}
+
+void
+trace_dict_exit(void)
+{
+    if (shards[0].ids == NULL)
+        return;
+
+    g_autofree char* report = g_strdup_printf("> INSN_DICT: %u entries\n", qatomic_read(&next_id) - 1);
+    qemu_plugin_outs(report);
+
+    if (file)
+    {
+        fclose(file);
+        file = NULL;
+    }
+
+    for (size_t i = 0; i < DICT_SHARDS; i++)
+    {
+        g_hash_table_destroy(shards[i].ids);
+        shards[i].ids = NULL;
+    }
+}
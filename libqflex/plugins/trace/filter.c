@@ -0,0 +1,84 @@
+/*
+ * Translation-time filters of the trace plugin.
+ *
+ * Instructions are selected by virtual or physical address range, exception
+ * level and class when their block is translated. Filtered out instructions
+ * get no callback registered at all, so they cost nothing at run time.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "middleware/libqflex/libqflex-module.h"
+#include "trace.h"
+
+static bool active = false;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+static inline bool
+in_range(uint64_t addr, uint64_t lo, uint64_t hi)
+{
+    return lo <= addr && addr <= hi;
+}
+
+void
+trace_filter_init(void)
+{
+    struct libqflex_state_t const * st = &qemu_libqflex_state;
+
+    active = st->filter_va_lo != 0 || st->filter_va_hi != UINT64_MAX ||
+             st->filter_pa_lo != 0 || st->filter_pa_hi != UINT64_MAX ||
+             st->filter_el_mask != 0xf ||
+             st->filter_class != TRACE_CLASS_ALL;
+}
+
+static bool
+in_scope(trace_insn_t const * insn)
+{
+    struct libqflex_state_t const * st = &qemu_libqflex_state;
+
+    return in_range(insn->target_pc_va, st->filter_va_lo, st->filter_va_hi) &&
+           in_range(insn->target_pc_pa, st->filter_pa_lo, st->filter_pa_hi) &&
+           (st->filter_el_mask & (1 << insn->exception_lvl));
+}
+
+unsigned int
+trace_filter(trace_insn_t const * insn)
+{
+    struct libqflex_state_t const * st = &qemu_libqflex_state;
+    // Undecoded instructions keep their memory callback, QEMU knows better
+    unsigned int const all = TRACE_FILTER_FETCH | TRACE_FILTER_MEM;
+
+    if (!active)
+        return all;
+
+    if (!in_scope(insn))
+        return TRACE_FILTER_NONE;
+
+    switch (st->filter_class)
+    {
+    case TRACE_CLASS_MEM:
+        return insn->has_mem_access ? all : TRACE_FILTER_MEM;
+
+    case TRACE_CLASS_BRANCH:
+        return (insn->branch_type != QEMU_Non_Branch) ? TRACE_FILTER_FETCH : TRACE_FILTER_NONE;
+
+    case TRACE_CLASS_ALL:
+    default:
+        return all;
+    }
+}
+
+bool
+trace_filter_block(trace_insn_t const * first)
+{
+    if (!active)
+        return true;
+
+    // Blocks are a fetch stream, there is none to send for memory-only traces
+    return qemu_libqflex_state.filter_class != TRACE_CLASS_MEM && in_scope(first);
+}
@@ -0,0 +1,375 @@
+/*
+ * Lock contention profiler built on the exclusive and atomic accesses
+ * (trace-sink=lock).
+ *
+ * Each vCPU follows its own load/store exclusive sequences. An attempt
+ * opens on a load exclusive and stays open while the same instruction loads
+ * the same line again:
+ *  - after a store exclusive, within a few instructions, the store failed;
+ *  - without a store exclusive, the vCPU spins on a held lock.
+ * It closes as acquired on a store exclusive followed by anything else, as
+ * abandoned when no store exclusive came. The instructions from the first
+ * to the last load exclusive of an attempt are the ones wasted waiting.
+ *
+ * QEMU fails a store exclusive whose reservation was lost (exception, CLREX)
+ * before touching memory, so that retry is seen as a spin. LSE atomics
+ * (CAS, SWP, LDADD...) never retry by themselves and are only counted.
+ *
+ * Closed attempts and LSE atomics are folded per lock line and per
+ * instruction in tables private to each vCPU, under a spinlock only the
+ * dump contends for. The dump merges the tables of every vCPU.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/thread.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "trace.h"
+
+#define LOCK_LINE_BITS      (6)
+// Instructions between a store exclusive and the load exclusive retrying it
+#define LOCK_RETRY_WINDOW   (16)
+// Bound of the lock lines and instructions kept per vCPU, further ones are
+// dropped
+#define LOCK_MAX_SITES      (1 << 16)
+
+typedef struct
+{
+    uint64_t    acquired;
+    uint64_t    abandoned;
+    uint64_t    failed;     // store exclusives retried
+    uint64_t    spins;      // load exclusives repeated without a store
+    uint64_t    wasted;     // instructions spent before the last try
+    uint64_t    lse;        // LSE atomics
+    uint64_t    vcpus;      // bitmask of the first 64 vCPUs
+} lock_stats_t;
+
+typedef struct
+{
+    // Lock line or instruction address, first for g_int64_hash
+    uint64_t        key;
+    lock_stats_t    stats;
+} lock_site_t;
+
+typedef struct
+{
+    // Attempt in progress
+    bool                open;
+    bool                stored;
+    physical_address_t  line;
+    logical_address_t   pc;
+    uint64_t            first;      // instructions at the first load exclusive
+    uint64_t            last;       // at the last one
+    uint64_t            store;      // at the store exclusive
+    uint32_t            failed;
+    uint32_t            spins;
+
+    // Folded attempts, taken by the dump too
+    QemuSpin            lock;
+    lock_stats_t        total;
+    GHashTable*         by_line;
+    GHashTable*         by_pc;
+    uint64_t            dropped;
+
+} __attribute__((aligned(64))) lock_vcpu_t;
+
+static lock_vcpu_t* vcpus = NULL;
+static size_t n_vcpus = 0;
+// Entries printed at exit
+static size_t report_top = 0;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+static inline void
+stats_add(lock_stats_t* to, lock_stats_t const * d)
+{
+    to->acquired  += d->acquired;
+    to->abandoned += d->abandoned;
+    to->failed    += d->failed;
+    to->spins     += d->spins;
+    to->wasted    += d->wasted;
+    to->lse       += d->lse;
+    to->vcpus     |= d->vcpus;
+}
+
+static GHashTable*
+sites_new(void)
+{
+    return g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+}
+
+/**
+ * Fold `d' into the site of `key', unless `sites' already holds `max_sites'
+ * other sites.
+ *
+ * @return False if `d' was dropped.
+ */
+static bool
+site_add(GHashTable* sites, uint64_t key, lock_stats_t const * d, size_t max_sites)
+{
+    lock_site_t* site = g_hash_table_lookup(sites, &key);
+
+    if (site == NULL)
+    {
+        if (g_hash_table_size(sites) >= max_sites)
+            return false;
+
+        site = g_new0(lock_site_t, 1);
+        site->key = key;
+        g_hash_table_insert(sites, &site->key, site);
+    }
+
+    stats_add(&site->stats, d);
+    return true;
+}
+
+/**
+ * Fold `d' into the total and the sites of a vCPU, from its own thread.
+ */
+static void
+vcpu_add(lock_vcpu_t* v, uint64_t line, logical_address_t pc, lock_stats_t const * d)
+{
+    qemu_spin_lock(&v->lock);
+
+    stats_add(&v->total, d);
+
+    if (!site_add(v->by_line, line, d, LOCK_MAX_SITES))
+        v->dropped++;
+    if (!site_add(v->by_pc, pc, d, LOCK_MAX_SITES))
+        v->dropped++;
+
+    qemu_spin_unlock(&v->lock);
+}
+
+static void
+attempt_close(lock_vcpu_t* v, unsigned int vcpu_index)
+{
+    if (!v->open)
+        return;
+
+    lock_stats_t const d = {
+        .acquired  = v->stored,
+        .abandoned = !v->stored,
+        .failed    = v->failed,
+        .spins     = v->spins,
+        .wasted    = v->last - v->first,
+        .vcpus     = 1ull << (vcpu_index % 64),
+    };
+
+    v->open = false;
+    vcpu_add(v, v->line << LOCK_LINE_BITS, v->pc, &d);
+}
+
+static void
+load_exclusive(lock_vcpu_t* v, unsigned int vcpu_index, memory_transaction_t const * tr, uint64_t now)
+{
+    physical_address_t const line = tr->s.physical_address >> LOCK_LINE_BITS;
+
+    if (v->open && v->pc == tr->s.pc && v->line == line)
+    {
+        if (!v->stored)
+            v->spins++;
+        else if (now - v->store <= LOCK_RETRY_WINDOW)
+            v->failed++;
+        else
+            // Taken, released and taken again by the same code
+            attempt_close(v, vcpu_index);
+    }
+    else
+        attempt_close(v, vcpu_index);
+
+    if (!v->open)
+    {
+        v->open   = true;
+        v->line   = line;
+        v->pc     = tr->s.pc;
+        v->first  = now;
+        v->failed = 0;
+        v->spins  = 0;
+    }
+
+    v->last   = now;
+    v->stored = false;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_lock_init(size_t n, size_t top)
+{
+    n_vcpus = n;
+    report_top = top;
+    vcpus = g_new0(lock_vcpu_t, n_vcpus);
+
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        qemu_spin_init(&vcpus[i].lock);
+        vcpus[i].by_line = sites_new();
+        vcpus[i].by_pc   = sites_new();
+    }
+}
+
+void
+trace_lock_access(unsigned int vcpu_index, memory_transaction_t const * tr)
+{
+    lock_vcpu_t* v = &vcpus[vcpu_index];
+
+    if (tr->s.type != QEMU_Trans_Load && tr->s.type != QEMU_Trans_Store)
+        return;
+
+    // Any other store to the lock after the store exclusive releases it
+    if (!tr->s.atomic)
+    {
+        if (v->open && v->stored && tr->s.type == QEMU_Trans_Store &&
+            (tr->s.physical_address >> LOCK_LINE_BITS) == v->line)
+            attempt_close(v, vcpu_index);
+        return;
+    }
+
+    switch (decode_armv8_excl_opcode(tr->s.opcode))
+    {
+    case TRACE_EXCL_LOAD:
+        load_exclusive(v, vcpu_index, tr, trace_count_get_insns(vcpu_index));
+        break;
+
+    case TRACE_EXCL_STORE:
+        // Both the load and the store half of an STXR come here
+        if (v->open && (tr->s.physical_address >> LOCK_LINE_BITS) == v->line)
+        {
+            v->stored = true;
+            v->store  = trace_count_get_insns(vcpu_index);
+        }
+        break;
+
+    case TRACE_EXCL_NONE:
+        // LSE atomic, counted once on its load half
+        if (tr->s.type == QEMU_Trans_Load)
+        {
+            lock_stats_t const d = { .lse = 1, .vcpus = 1ull << (vcpu_index % 64) };
+
+            vcpu_add(v, tr->s.physical_address & ~((1ull << LOCK_LINE_BITS) - 1), tr->s.pc, &d);
+        }
+        break;
+    }
+}
+
+static gint
+cmp_contention(gconstpointer a, gconstpointer b)
+{
+    lock_stats_t const * x = &(*(lock_site_t* const *) a)->stats;
+    lock_stats_t const * y = &(*(lock_site_t* const *) b)->stats;
+
+    if (x->wasted != y->wasted)
+        return (x->wasted < y->wasted) ? 1 : -1;
+
+    uint64_t const cx = x->failed + x->spins + x->lse;
+    uint64_t const cy = y->failed + y->spins + y->lse;
+
+    return (cx < cy) - (cx > cy);
+}
+
+/**
+ * Fold the sites of a vCPU into `to'. The lock of the vCPU must be held.
+ */
+static void
+sites_merge(GHashTable* to, GHashTable* from)
+{
+    GHashTableIter it;
+    gpointer site;
+
+    g_hash_table_iter_init(&it, from);
+    while (g_hash_table_iter_next(&it, NULL, &site))
+        site_add(to, ((lock_site_t*) site)->key, &((lock_site_t*) site)->stats, G_MAXSIZE);
+}
+
+static void
+dump_sites(GString* out, char const * name, GHashTable* sites, size_t top)
+{
+    g_autoptr(GPtrArray) sorted = g_ptr_array_new();
+
+    GHashTableIter it;
+    gpointer site;
+
+    g_hash_table_iter_init(&it, sites);
+    while (g_hash_table_iter_next(&it, NULL, &site))
+        g_ptr_array_add(sorted, site);
+
+    g_ptr_array_sort(sorted, cmp_contention);
+
+    for (size_t i = 0; i < MIN(top, sorted->len); i++)
+    {
+        lock_site_t const * s = g_ptr_array_index(sorted, i);
+
+        g_string_append_printf(out,
+            "> LOCK_%s[%zu] 0x%016" PRIx64 " WASTED: %" PRIu64 " FAILED: %" PRIu64 " SPINS: %" PRIu64
+            " ACQUIRED: %" PRIu64 " ABANDONED: %" PRIu64 " LSE: %" PRIu64 " VCPUS: 0x%" PRIx64 "\n",
+            name, i, s->key, s->stats.wasted, s->stats.failed, s->stats.spins,
+            s->stats.acquired, s->stats.abandoned, s->stats.lse, s->stats.vcpus);
+    }
+}
+
+void
+trace_lock_dump(GString* out, size_t top)
+{
+    if (vcpus == NULL)
+        return;
+
+    g_autoptr(GHashTable) by_line = sites_new();
+    g_autoptr(GHashTable) by_pc = sites_new();
+    uint64_t dropped = 0;
+
+    // Attempts in progress are left out
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        lock_vcpu_t* v = &vcpus[i];
+        uint64_t const insns = trace_count_get_insns(i);
+
+        qemu_spin_lock(&v->lock);
+
+        lock_stats_t const t = v->total;
+        sites_merge(by_line, v->by_line);
+        sites_merge(by_pc, v->by_pc);
+        dropped += v->dropped;
+
+        qemu_spin_unlock(&v->lock);
+
+        g_string_append_printf(out,
+            "> LOCK CPU[%zu] ACQUIRED: %" PRIu64 " ABANDONED: %" PRIu64 " FAILED: %" PRIu64
+            " SPINS: %" PRIu64 " WASTED: %" PRIu64 " (%.2f%% of %" PRIu64 " insns) LSE: %" PRIu64 "\n",
+            i, t.acquired, t.abandoned, t.failed, t.spins, t.wasted,
+            insns ? 100. * t.wasted / insns : 0., insns, t.lse);
+    }
+
+    dump_sites(out, "ADDR", by_line, top);
+    dump_sites(out, "PC", by_pc, top);
+
+    if (dropped)
+        g_string_append_printf(out, "> LOCK: %" PRIu64 " updates dropped over %u sites per vCPU\n",
+                               dropped, LOCK_MAX_SITES);
+}
+
+void
+trace_lock_exit(void)
+{
+    if (vcpus == NULL)
+        return;
+
+    for (size_t i = 0; i < n_vcpus; i++)
+        attempt_close(&vcpus[i], i);
+
+    g_autoptr(GString) report = g_string_new("");
+
+    trace_lock_dump(report, report_top);
+    qemu_plugin_outs(report->str);
+
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        g_hash_table_destroy(vcpus[i].by_line);
+        g_hash_table_destroy(vcpus[i].by_pc);
+    }
+    g_free(vcpus);
+    vcpus = NULL;
+}
@@ -45,7 +45,7 @@ static bool disas_ldst_ldapr_stlr(struct mem_access* s, uint32_t opcode)
         is_signed = true;
         break;
     default:
-        g_assert_not_reached();
+        return false;
     }
 
     if (is_store) {
@@ -305,7 +305,7 @@ static bool disas_ldst_single_struct(struct mem_access* s, uint32_t opcode)
         }
         break;
     default:
-        g_assert_not_reached();
+        return false;
     }
 
     for (xs = 0; xs < selem; xs++) {
@@ -414,8 +414,7 @@ static bool disas_ldst_pair(struct mem_access* s, uint32_t opcode)
     }
 
     if (set_tag) {
-        // Unsupported
-        printf("ERROR:QFlex, We do not support memory callbacks for tags.");
+        // Unsupported, only the data pair is reported
         /*
         if (!s->ata) {
             gen_helper_stg_stub(cpu_env, dirty_addr);
@@ -562,6 +561,7 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
           .is_store = true,
           .is_signed = false,
           .is_pair = false,
+          .is_atomic = true,
           .accesses = 2};
         return true;
 
@@ -574,6 +574,7 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
           .is_store = false,
           .is_signed = false,
           .is_pair = false,
+          .is_atomic = true,
           .accesses = 1};
         return true;
 
@@ -622,6 +623,7 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
                       .is_store = true,
                       .is_signed = false,
                       .is_pair = true,
+                      .is_atomic = true,
                       .accesses = 2};
             } else {
                 // Must access 2x64 bits in two access
@@ -631,6 +633,7 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
                       .is_store = true,
                       .is_signed = false,
                       .is_pair = true,
+                      .is_atomic = true,
                       .accesses = 4};
             }
             return true;
@@ -645,6 +648,7 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
                   .is_store = true,
                   .is_signed = false,
                   .is_pair = true,
+                  .is_atomic = true,
                   .accesses = 4};
             return true;
         }
@@ -662,6 +666,7 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
                       .is_store = false,
                       .is_signed = false,
                       .is_pair = true,
+                      .is_atomic = true,
                       .accesses = 1};
             } else {
                 // Must access 2x64 bits in two access
@@ -671,6 +676,7 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
                       .is_store = false,
                       .is_signed = false,
                       .is_pair = true,
+                      .is_atomic = true,
                       .accesses = 2};
             }
             return true;
@@ -685,6 +691,7 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
                   .is_store = true,
                   .is_signed = false,
                   .is_pair = true,
+                  .is_atomic = true,
                   .accesses = 4};
             return true;
         }
@@ -702,6 +709,7 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
                   .is_store = true,
                   .is_signed = false,
                   .is_pair = false,
+                  .is_atomic = true,
                   .accesses = 2};
             return true;
         }
@@ -711,6 +719,17 @@ static bool disas_ldst_excl(struct mem_access* s, uint32_t opcode)
     return false;
 }
 
+trace_excl_t
+decode_armv8_excl_opcode(uint32_t opcode)
+{
+    // Load/store exclusive class with o2 = 0, CASP has o1 = 1 and sz < 2
+    if (extract32(opcode, 24, 6) != 0x08 || extract32(opcode, 23, 1) ||
+        (extract32(opcode, 21, 1) && !extract32(opcode, 31, 1)))
+        return TRACE_EXCL_NONE;
+
+    return extract32(opcode, 22, 1) ? TRACE_EXCL_LOAD : TRACE_EXCL_STORE;
+}
+
 /*
  * PAC memory operations
  *
@@ -933,6 +952,7 @@ static bool disas_ldst_atomic(struct mem_access* s, uint32_t opcode,
           .is_store = true,
           .is_signed = is_signed,
           .is_pair = false,
+          .is_atomic = true,
           .accesses = 2}; // Given that it's Aquire + Release, is it 2 access?
     return true;
 }
@@ -1112,7 +1132,7 @@ static bool disas_ldst_reg_imm9(struct mem_access* s, uint32_t opcode,
     case 3:
         break;
     default:
-        g_assert_not_reached();
+        return false;
     }
 
     *s = (struct mem_access) {.size = size,
@@ -1257,7 +1277,7 @@ disas_ldst(struct mem_access* s, uint32_t opcode)
         break;
     case 0x19:
         if (extract32(opcode, 21, 1) != 0) {
-            printf("ERROR:QFlex, We do not support memory callbacks for tags.\n");
+            // Tag accesses are left to QEMU, reported as undecoded
             // has_mem_access = disas_ldst_tag(s, opcode);
             return false;
         } else if (extract32(opcode, 10, 2) == 0) {
@@ -1324,8 +1344,7 @@ disas_branch_sys(struct mem_access* s, uint32_t opcode)
                                                     size = 2;       /* Everything should be 32-bit */
                                                     break;
                                                 default:
-                                                    printf("[Error]:QFlex, Unallocated encoding.\n");
-                                                    g_assert_not_reached();
+                                                    /* AT, TLBI and friends, no data access */
                                                     break;
                                             }
                                             break;
@@ -1383,7 +1402,8 @@ disas_sve(struct mem_access* s, uint32_t opcode)
         case 0x4:
             has_mem_access = true;  /* SVE Memory - 32-bit Gather and Unsized Contiguous */
             is_store = false;       /* All Prefetch (Load) instructions */
-            g_assert(extract32(opcode, 25, 4) == 0x2);
+            if (extract32(opcode, 25, 4) != 0x2)
+                return false;
             switch(extract32(opcode, 23, 2)) {
                 case 0x3:           /* LDR, and SVE prefetch */
                     switch(extract32(opcode, 22, 1)) {
@@ -1453,7 +1473,8 @@ disas_sve(struct mem_access* s, uint32_t opcode)
         case 0x5:
             has_mem_access = true;  /* SVE Memory - Contiguous Load */
             is_store = false;       /* All Contiguous load instructions */
-            g_assert(extract32(opcode, 25, 4) == 0x2);
+            if (extract32(opcode, 25, 4) != 0x2)
+                return false;
             switch(extract32(opcode, 13, 3)) {
                 case 0x0:
                     size = extract32(opcode, 23, 2);
@@ -1512,11 +1533,11 @@ disas_sve(struct mem_access* s, uint32_t opcode)
                                 size = extract32(opcode, 23, 2);
                             else {
                                 size = 4;
-                                printf("[Warn]:QFlex, loading quadwords, setting size_t = 4.\n");
                             }
                             break;
                         default:
-                            g_assert(extract32(opcode, 20, 1) == 0x0); /* The other one is unallocated */
+                            if (extract32(opcode, 20, 1) != 0x0)    /* The other one is unallocated */
+                                return false;
                             size = extract32(opcode, 23, 2);
                             break;
                     }
@@ -1527,10 +1548,8 @@ disas_sve(struct mem_access* s, uint32_t opcode)
                         case 0x1:
                             size = extract32(opcode, 23, 2);
                             break;
-                        default:
-                            printf("[Error]:QFlex, Unallocated encoding.\n");
-                            g_assert_not_reached();
-                            break;
+                        default:            /* Unallocated */
+                            return false;
                     }
                     break;
             }
@@ -1539,12 +1558,14 @@ disas_sve(struct mem_access* s, uint32_t opcode)
             has_mem_access = true;  /* SVE Memory - 64-bit Gather */
             size = 3;               /* 64-bit */
             is_store = false;       /* All Gather (Load) instructions */
-            g_assert(extract32(opcode, 25, 4) == 0x2);
+            if (extract32(opcode, 25, 4) != 0x2)
+                return false;
             break;
         case 0x7:
             has_mem_access = true;  /* Misc SVE store operations */
             is_store = true;
-            g_assert(extract32(opcode, 25, 4) == 0x2);
+            if (extract32(opcode, 25, 4) != 0x2)
+                return false;
             switch(extract32(opcode, 13, 3)) {
                 case 0x0:
                 case 0x2:
@@ -1557,7 +1578,6 @@ disas_sve(struct mem_access* s, uint32_t opcode)
                                 size = extract32(opcode, 23, 2);
                             else {
                                 size = 4;
-                                printf("[Warn]:QFlex, loading quadwords, setting size_t = 4.\n");
                             }
                             break;
                     }
@@ -1565,7 +1585,6 @@ disas_sve(struct mem_access* s, uint32_t opcode)
                 case 0x1:
                     if(extract32(opcode, 21, 1)==0x1) {
                         size = 4;
-                        printf("[Warn]:QFlex, loading quadwords, setting size_t = 4.\n");
                     } else {
                         size = (extract32(opcode, 22, 1) == 0x0) ? 3 : 2;
                     }
@@ -1633,11 +1652,12 @@ decode_armv8_mem_opcode(struct mem_access* s, uint32_t opcode)
     case 0xf:      /* Data processing - SIMD and floating point */
         break;
     default:
-        g_assert_not_reached(); /* all 15 cases should be handled above */
+        return false;
     }
 
-    if(!has_mem_access)
-        printf("ERROR:QFlex, No memory access found for opcode: %x.\n", opcode);
-
+    /*
+     * Every translated instruction goes through here, so not accessing
+     * memory is the common case and not an error.
+     */
     return has_mem_access;
 }
@@ -0,0 +1,583 @@
+/*
+ * Deterministic merge of the per-vCPU event streams (-libqflex trace-order=on).
+ *
+ * vCPUs keep running in parallel and append their events, stamped with
+ * their own instruction count, to a private queue. A single merge thread
+ * cuts every stream into quanta of `order-quantum' instructions and hands
+ * them to Flexus quantum by quantum, vCPU by vCPU:
+ *
+ *   vCPU 0 [0, Q)  vCPU 1 [0, Q)  ...  vCPU 0 [Q, 2Q)  vCPU 1 [Q, 2Q)  ...
+ *
+ * and numbers the events in that order. Flexus is called from the merge
+ * thread only, sample phase changes and dictionary entries included, so it
+ * needs no lock. They are relayed before the next events delivered, which
+ * for a phase change may still include events emitted shortly before it.
+ *
+ * The merge moves past a vCPU once it saw an event of the vCPU beyond the
+ * quantum, or once the vCPU published progress beyond it. vCPUs publish
+ * their progress a few times per quantum from a conditional callback, so
+ * filtered out code does not hold the merge back, and go out of the way
+ * while halted.
+ *
+ * As long as every event is delivered in the quantum of its stamp, the
+ * interleaving only depends on what each vCPU executed, not on how the host
+ * scheduled the threads. A halted vCPU stops counting instructions while
+ * the merge moves on: its first events after resuming are stamped in a
+ * quantum already delivered, and go to the quantum the merge is at, after
+ * the vCPUs of lower index. Where that is depends on the host, like the
+ * wake up itself. Such events are counted as late in the report; a run
+ * without late events has the deterministic interleaving.
+ *
+ * A vCPU never waits on the merge while it appends events, which would
+ * deadlock against a vCPU waiting for it in an exclusive section. Instead,
+ * a vCPU more than ORDER_QUEUE_CHUNKS chunks ahead waits at its next
+ * progress callback, at a block boundary, until the merge catches up. After
+ * ORDER_STALL_TIMEOUT_US without the merge freeing any of its chunks, the
+ * merge is waiting for a vCPU that cannot run, maybe one waiting for this
+ * one. The merge then stops waiting for progress: it delivers the events
+ * already queued, quantum by quantum, and takes the vCPUs with nothing
+ * queued as halted, until the waiting vCPU is under ORDER_QUEUE_CHUNKS
+ * again. Events the lagging vCPUs append later are late. Opcodes of block
+ * events are copied in the chunks, so TB flushes need no drain.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/log.h"
+
+#include "qemu/qemu-plugin.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "middleware/libqflex/libqflex-module.h"
+#include "trace.h"
+
+#define ORDER_CHUNK_EVENTS  (1024)
+#define ORDER_CHUNK_OPCODES (4096)
+// Merge spin rounds without progress before going to sleep
+#define ORDER_IDLE_SPIN     (64)
+#define ORDER_IDLE_SLEEP_US (50)
+// Longest period of the progress callback, in instructions
+#define ORDER_PROGRESS_MAX  (16384)
+
+// Chunks of a queue beyond which its vCPU waits for the merge
+#define ORDER_QUEUE_CHUNKS      (64)
+#define ORDER_STALL_SLEEP_US    (50)
+#define ORDER_STALL_TIMEOUT_US  (100 * 1000)
+
+typedef struct order_chunk
+{
+    // Both published by the producer with release semantics. The chunk
+    // is never written again once `next' is set.
+    struct order_chunk*     next;
+    uint32_t                count;
+
+    // Producer only
+    uint32_t                n_opcodes;
+
+    memory_transaction_t    tr[ORDER_CHUNK_EVENTS];
+    trace_stamp_t           stamp[ORDER_CHUNK_EVENTS];
+    uint32_t                opcodes[ORDER_CHUNK_OPCODES];
+
+} order_chunk_t;
+
+typedef struct
+{
+    // Producer side (vCPU thread), on its own cache line
+    order_chunk_t*  tail        __attribute__((aligned(64)));
+    // No event below `progress' will be appended anymore
+    uint64_t        progress;
+    bool            idle;
+    // Chunks allocated and not yet released, written by both sides
+    uint32_t        chunks;
+
+    // Consumer side (merge thread), on its own cache line
+    order_chunk_t*  head        __attribute__((aligned(64)));
+    uint32_t        read;
+
+} order_queue_t;
+
+/**
+ * Flexus call made by a vCPU thread, relayed by the merge thread.
+ */
+typedef struct
+{
+    bool            is_phase;
+    sample_phase_t  phase;
+    static_insn_t   insn;
+} order_notice_t;
+
+static order_queue_t*   queues = NULL;
+static size_t           n_queues = 0;
+
+static uint64_t         quantum = 0;
+static GThread*         merger = NULL;
+static bool             stop_merger = false;
+
+static struct qemu_plugin_scoreboard* since = NULL;
+static qemu_plugin_u64  since_insns;
+
+static GAsyncQueue*     notices = NULL;
+
+// Chunks allocated and not yet released, and their peak
+static uint64_t         n_chunks = 0;
+static uint64_t         max_chunks = 0;
+
+// vCPUs that waited for the merge, and timed out
+static uint64_t         n_stalls = 0;
+static uint64_t         n_stall_timeouts = 0;
+// vCPUs timed out and still waiting, the merge drains meanwhile
+static uint32_t         n_pressing = 0;
+
+// Merge thread only
+static uint64_t         seq = 0;
+static uint64_t         n_quanta = 0;
+static uint64_t         n_late = 0;
+
+// ─── Queue ───────────────────────────────────────────────────────────────────
+
+static order_chunk_t*
+chunk_new(order_queue_t* q)
+{
+    order_chunk_t* chunk = g_new(order_chunk_t, 1);
+
+    chunk->next      = NULL;
+    chunk->count     = 0;
+    chunk->n_opcodes = 0;
+
+    qatomic_inc(&q->chunks);
+
+    uint64_t const n = qatomic_fetch_inc(&n_chunks) + 1;
+    if (n > qatomic_read(&max_chunks))
+        qatomic_set(&max_chunks, n);
+
+    return chunk;
+}
+
+static void
+chunk_free(order_queue_t* q, order_chunk_t* chunk)
+{
+    qatomic_dec(&q->chunks);
+    qatomic_dec(&n_chunks);
+    g_free(chunk);
+}
+
+/**
+ * Make the Flexus calls relayed from the vCPU threads so far.
+ */
+static void
+notices_deliver(void)
+{
+    order_notice_t* notice;
+
+    while ((notice = g_async_queue_try_pop(notices)) != NULL)
+    {
+        if (notice->is_phase)
+            flexus_api.sample_phase(notice->phase);
+        else
+            flexus_api.static_insn(&notice->insn);
+
+        g_free(notice);
+    }
+}
+
+/**
+ * Deliver the events of a queue stamped below `end', at most the rest of
+ * the head chunk.
+ *
+ * @return The number of events delivered.
+ */
+static size_t
+queue_consume(size_t vcpu_index, order_queue_t* q, uint64_t end)
+{
+    order_chunk_t* chunk = q->head;
+    order_chunk_t* next = qatomic_load_acquire(&chunk->next);
+    uint32_t const count = qatomic_load_acquire(&chunk->count);
+
+    if (q->read == count)
+    {
+        if (next == NULL)
+            return 0;
+
+        q->head = next;
+        q->read = 0;
+        chunk_free(q, chunk);
+        return queue_consume(vcpu_index, q, end);
+    }
+
+    uint32_t const start = q->read;
+    uint32_t i = start;
+
+    for (; i < count && chunk->stamp[i].icount < end; i++)
+    {
+        chunk->stamp[i].seq = seq++;
+
+        // Stamped in a quantum delivered already, see the top of the file
+        if (chunk->stamp[i].icount + quantum < end)
+            n_late++;
+    }
+
+    if (i == start)
+        return 0;
+
+    size_t const n = i - start;
+
+    // Dictionary entries of these events were relayed before them
+    notices_deliver();
+
+    if (qemu_libqflex_state.api_version >= 7)
+        flexus_api.trace_mem_ordered(vcpu_index, &chunk->tr[start], &chunk->stamp[start], n);
+    else if (qemu_libqflex_state.api_version >= 2)
+        flexus_api.trace_mem_batch(vcpu_index, &chunk->tr[start], n);
+    else
+        for (size_t j = start; j < i; j++)
+            flexus_api.trace_mem(vcpu_index, &chunk->tr[j]);
+
+    q->read = i;
+    return n;
+}
+
+/**
+ * Stamp of the next event of a queue, UINT64_MAX if there is none yet.
+ */
+static uint64_t
+queue_next(order_queue_t* q)
+{
+    order_chunk_t* chunk = q->head;
+    order_chunk_t* next = qatomic_load_acquire(&chunk->next);
+    uint32_t const count = qatomic_load_acquire(&chunk->count);
+
+    if (q->read < count)
+        return chunk->stamp[q->read].icount;
+
+    // Only the first event of the next chunk can be pending
+    if (next && qatomic_load_acquire(&next->count))
+        return next->stamp[0].icount;
+
+    return UINT64_MAX;
+}
+
+/**
+ * True once the queue holds an event stamped at or beyond `end', or the
+ * vCPU will append none below it. With `drain', a queue with no pending
+ * event is taken as halted.
+ */
+static bool
+queue_past(order_queue_t* q, uint64_t end, bool drain)
+{
+    // Read before looking at the events, which are published first
+    bool const idle = qatomic_load_acquire(&q->idle);
+    uint64_t const progress = qatomic_load_acquire(&q->progress);
+    uint64_t const next = queue_next(q);
+
+    if (next != UINT64_MAX)
+        return next >= end;
+
+    return drain || idle || progress >= end;
+}
+
+/**
+ * Lowest stamp any vCPU may still deliver, UINT64_MAX if every vCPU is
+ * halted with nothing pending. Quanta below it are empty and skipped.
+ */
+static uint64_t
+queues_lowest(bool drain)
+{
+    uint64_t lowest = UINT64_MAX;
+
+    for (size_t i = 0; i < n_queues; i++)
+    {
+        bool const idle = qatomic_load_acquire(&queues[i].idle);
+        uint64_t const progress = qatomic_load_acquire(&queues[i].progress);
+        uint64_t const next = queue_next(&queues[i]);
+
+        lowest = MIN(lowest, next);
+        if (!drain && !idle)
+            lowest = MIN(lowest, progress);
+    }
+
+    return lowest;
+}
+
+// ─── Merge ───────────────────────────────────────────────────────────────────
+
+/**
+ * Merge loop. `cur' is the vCPU being delivered and `end' the end of the
+ * current quantum; after the last vCPU the next quantum starts over.
+ */
+static gpointer
+order_merge_loop(gpointer opaque)
+{
+    size_t cur = 0;
+    uint64_t end = quantum;
+    size_t idle = 0;
+
+    while (true)
+    {
+        bool const final = qatomic_read(&stop_merger);
+        bool const drain = final || qatomic_read(&n_pressing);
+        size_t delivered = 0;
+
+        notices_deliver();
+
+        while (cur < n_queues)
+        {
+            delivered += queue_consume(cur, &queues[cur], end);
+
+            if (!queue_past(&queues[cur], end, drain))
+                break;
+
+            cur++;
+        }
+
+        if (cur == n_queues)
+        {
+            uint64_t const lowest = queues_lowest(drain);
+
+            if (lowest != UINT64_MAX)
+            {
+                cur = 0;
+                end = (lowest / quantum + 1) * quantum;
+                n_quanta++;
+                continue;
+            }
+
+            // Nothing left once the vCPUs are stopped
+            if (final)
+                break;
+
+            // Every vCPU halted, hold the quantum until one resumes
+            cur = 0;
+        }
+
+        if (delivered)
+        {
+            idle = 0;
+            continue;
+        }
+
+        if (++idle < ORDER_IDLE_SPIN)
+            continue;
+
+        g_usleep(ORDER_IDLE_SLEEP_US);
+    }
+
+    notices_deliver();
+    return NULL;
+}
+
+// ─── Callbacks ───────────────────────────────────────────────────────────────
+
+/**
+ * Wait for the merge to bring a queue back under ORDER_QUEUE_CHUNKS, see
+ * the top of the file.
+ */
+static void
+queue_throttle(order_queue_t* q)
+{
+    uint32_t chunks = qatomic_read(&q->chunks);
+
+    if (chunks < ORDER_QUEUE_CHUNKS)
+        return;
+
+    qatomic_inc(&n_stalls);
+    gint64 deadline = g_get_monotonic_time() + ORDER_STALL_TIMEOUT_US;
+    bool pressing = false;
+
+    while (chunks >= ORDER_QUEUE_CHUNKS)
+    {
+        // The merge waits for a vCPU that does not run, make it drain
+        if (!pressing && g_get_monotonic_time() >= deadline)
+        {
+            qatomic_inc(&n_stall_timeouts);
+            qatomic_inc(&n_pressing);
+            pressing = true;
+        }
+
+        g_usleep(ORDER_STALL_SLEEP_US);
+
+        uint32_t const now = qatomic_read(&q->chunks);
+        if (now < chunks)
+            deadline = g_get_monotonic_time() + ORDER_STALL_TIMEOUT_US;
+        chunks = now;
+    }
+
+    if (pressing)
+        qatomic_dec(&n_pressing);
+}
+
+/**
+ * Called a few times per quantum of a vCPU, before a block. Every event of
+ * the previous instructions was appended already.
+ */
+static void
+dispatch_progress(unsigned int vcpu_index, void* userdata)
+{
+    order_queue_t* q = &queues[vcpu_index];
+
+    qemu_plugin_u64_set(since_insns, vcpu_index, 0);
+
+    qatomic_set(&q->idle, false);
+    qatomic_store_release(&q->progress, trace_count_get_insns(vcpu_index));
+
+    // Progress first, the merge may be waiting for it
+    queue_throttle(q);
+}
+
+static void
+dispatch_idle(qemu_plugin_id_t id, unsigned int vcpu_index)
+{
+    if (vcpu_index < n_queues)
+        qatomic_store_release(&queues[vcpu_index].idle, true);
+}
+
+static void
+dispatch_resume(qemu_plugin_id_t id, unsigned int vcpu_index)
+{
+    if (vcpu_index < n_queues)
+        qatomic_store_release(&queues[vcpu_index].idle, false);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_order_init(size_t n_vcpus, uint64_t quantum_insns)
+{
+    g_assert(n_vcpus > 0 && quantum_insns > 0);
+
+    quantum = quantum_insns;
+    n_queues = n_vcpus;
+    queues = g_new0(order_queue_t, n_queues);
+
+    for (size_t i = 0; i < n_queues; i++)
+    {
+        queues[i].tail = queues[i].head = chunk_new(&queues[i]);
+        // Not started yet, as if halted until it runs
+        queues[i].idle = true;
+    }
+
+    notices = g_async_queue_new();
+
+    since = qemu_plugin_scoreboard_new(sizeof(uint64_t));
+    since_insns = qemu_plugin_scoreboard_u64(since);
+
+    merger = g_thread_new("qflex-order", order_merge_loop, NULL);
+
+    qemu_log("> [Libqflex] TRACE_ORDER  =quantum:%" PRIu64 "\n", quantum);
+}
+
+void
+trace_order_attach(qemu_plugin_id_t id)
+{
+    if (queues == NULL)
+        return;
+
+    qemu_plugin_register_vcpu_idle_cb(id, dispatch_idle);
+    qemu_plugin_register_vcpu_resume_cb(id, dispatch_resume);
+}
+
+void
+trace_order_register(struct qemu_plugin_tb* tb)
+{
+    if (queues == NULL)
+        return;
+
+    qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+        tb, QEMU_PLUGIN_INLINE_ADD_U64, since_insns, qemu_plugin_tb_n_insns(tb));
+
+    qemu_plugin_register_vcpu_tb_exec_cond_cb(
+        tb, dispatch_progress, QEMU_PLUGIN_CB_NO_REGS,
+        QEMU_PLUGIN_COND_GE, since_insns, MAX(MIN(quantum / 4, ORDER_PROGRESS_MAX), 1), NULL);
+}
+
+void
+trace_order_push(unsigned int vcpu_index, memory_transaction_t const * tr)
+{
+    order_queue_t* q = &queues[vcpu_index];
+    order_chunk_t* chunk = q->tail;
+    uint32_t const n_opcodes = (tr->s.type == QEMU_Trans_Instr_Block) ? tr->block.n_insns : 0;
+
+    g_assert(n_opcodes <= ORDER_CHUNK_OPCODES);
+
+    // Does not wait for the resume callback, see trace_order_init()
+    if (q->idle)
+        qatomic_set(&q->idle, false);
+
+    if (chunk->count == ORDER_CHUNK_EVENTS ||
+        chunk->n_opcodes + n_opcodes > ORDER_CHUNK_OPCODES)
+    {
+        order_chunk_t* next = chunk_new(q);
+
+        qatomic_store_release(&chunk->next, next);
+        q->tail = chunk = next;
+    }
+
+    uint32_t const i = chunk->count;
+
+    chunk->tr[i] = *tr;
+    chunk->stamp[i].icount = trace_count_get_insns(vcpu_index);
+
+    if (n_opcodes)
+    {
+        memcpy(&chunk->opcodes[chunk->n_opcodes], tr->block.opcodes, n_opcodes * sizeof(uint32_t));
+        chunk->tr[i].block.opcodes = &chunk->opcodes[chunk->n_opcodes];
+        chunk->n_opcodes += n_opcodes;
+    }
+
+    qatomic_store_release(&chunk->count, i + 1);
+}
+
+bool
+trace_order_sample_phase(sample_phase_t phase)
+{
+    if (queues == NULL)
+        return false;
+
+    order_notice_t* notice = g_new0(order_notice_t, 1);
+    notice->is_phase = true;
+    notice->phase    = phase;
+
+    g_async_queue_push(notices, notice);
+    return true;
+}
+
+bool
+trace_order_static_insn(static_insn_t const * insn)
+{
+    if (queues == NULL)
+        return false;
+
+    order_notice_t* notice = g_new0(order_notice_t, 1);
+    notice->insn = *insn;
+
+    g_async_queue_push(notices, notice);
+    return true;
+}
+
+void
+trace_order_exit(void)
+{
+    if (queues == NULL)
+        return;
+
+    qatomic_set(&stop_merger, true);
+    g_thread_join(merger);
+
+    g_autofree char* report = g_strdup_printf(
+        "> TRACE_ORDER: %" PRIu64 " events, %" PRIu64 " quanta, %" PRIu64 " late, "
+        "peak chunks: %" PRIu64 " (%" PRIu64 " MB), stalls: %" PRIu64 " (%" PRIu64 " timed out)\n",
+        seq, n_quanta, n_late, max_chunks, max_chunks * sizeof(order_chunk_t) / MiB,
+        n_stalls, n_stall_timeouts);
+    qemu_plugin_outs(report);
+
+    for (size_t i = 0; i < n_queues; i++)
+        chunk_free(&queues[i], queues[i].head);
+
+    g_async_queue_unref(notices);
+    notices = NULL;
+
+    g_free(queues);
+    queues = NULL;
+}
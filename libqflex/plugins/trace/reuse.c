@@ -0,0 +1,536 @@
+/*
+ * Online reuse distance profiler of the trace plugin (trace-sink=reuse).
+ *
+ * Builds the miss ratio curves of fully associative LRU caches, for the data
+ * and the instruction references, at cache line and page granularity,
+ * without writing a trace. It follows SHARDS (Waldspurger et al., FAST'15):
+ * a reference is only tracked when the hash of its line or page falls under
+ * a threshold T out of P, so that the tracked references are a spatially
+ * uniform sample of rate T/P and their reuse distances, scaled by P/T,
+ * estimate the distances of the whole stream. Once more than `reuse-entries'
+ * units are tracked, T is lowered and the units above it are dropped, which
+ * bounds the memory whatever the footprint of the guest. The counts taken
+ * so far are then scaled by T_new/T_old, as SHARDS_adj does, so that every
+ * sample stands for as many references whenever it was taken.
+ *
+ * Each vCPU profiles its own references from its own thread, nothing is
+ * shared but the output. Every `reuse-interval' instructions of a vCPU, the
+ * curves of the interval are written out; the LRU stacks carry over.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "trace.h"
+
+#define REUSE_HASH_BITS     (24)
+#define REUSE_HASH_RANGE    (1u << REUSE_HASH_BITS)
+#define REUSE_LINE_BITS     (6)
+#define REUSE_PAGE_BITS     (12)
+
+// Cache sizes of the curves, 2^0 to 2^(REUSE_BINS - 1) lines or pages
+#define REUSE_BINS          (32)
+
+// References between two looks at the instruction counter
+#define REUSE_CHECK_MASK    (1023)
+
+typedef enum { REUSE_DATA, REUSE_INSN, REUSE_STREAMS, } reuse_stream_t;
+typedef enum { REUSE_LINE, REUSE_PAGE, REUSE_UNITS, } reuse_unit_t;
+
+static char const * const stream_name[REUSE_STREAMS] = { "data", "insn" };
+static char const * const unit_name[REUSE_UNITS] = { "line", "page" };
+static unsigned int const unit_bits[REUSE_UNITS] = { REUSE_LINE_BITS, REUSE_PAGE_BITS };
+
+typedef struct
+{
+    // Key of the table, line or page number
+    uint64_t    unit;
+    // Last access, in sampled references of the tracker
+    uint64_t    time;
+    uint32_t    hash;
+    // Last interval the unit was referenced in
+    uint32_t    interval;
+} reuse_entry_t;
+
+typedef struct
+{
+    uint64_t refs;
+    // Counts of samples at the current threshold, see hist_rescale()
+    double   sampled;
+    double   cold;
+    // Sampled units referenced in the interval
+    double   distinct;
+    // Sampled references by scaled reuse distance, bin k holds [2^(k-1), 2^k)
+    double   hist[REUSE_BINS];
+} reuse_hist_t;
+
+typedef struct
+{
+    GHashTable*     units;
+    // Fenwick tree over the access times, one bit per tracked unit
+    uint32_t*       tree;
+    uint64_t        now;
+    uint32_t        threshold;
+
+    reuse_hist_t    interval;
+    reuse_hist_t    total;
+} reuse_tracker_t;
+
+typedef struct
+{
+    reuse_tracker_t tracker[REUSE_STREAMS][REUSE_UNITS];
+    uint64_t        refs;
+    uint64_t        next_insns;
+    uint32_t        n_interval;
+} __attribute__((aligned(64))) reuse_vcpu_t;
+
+static reuse_vcpu_t* vcpus = NULL;
+static size_t n_vcpus = 0;
+
+static size_t max_entries = 0;
+// Bound of the access times before they are renumbered
+static size_t max_time = 0;
+static uint64_t interval_len = 0;
+
+static GMutex lock;
+// Protected by `lock', NULL to write to the plugin output
+static FILE* file = NULL;
+
+// ─── Fenwick Tree ────────────────────────────────────────────────────────────
+
+static inline void
+fenwick_add(reuse_tracker_t* t, uint64_t i, int32_t v)
+{
+    for (; i <= max_time; i += i & -i)
+        t->tree[i] += v;
+}
+
+/**
+ * Tracked units accessed at or before `i'.
+ */
+static inline uint64_t
+fenwick_sum(reuse_tracker_t const * t, uint64_t i)
+{
+    uint64_t sum = 0;
+
+    for (; i > 0; i -= i & -i)
+        sum += t->tree[i];
+
+    return sum;
+}
+
+// ─── Tracker ─────────────────────────────────────────────────────────────────
+
+static inline uint32_t
+unit_hash(uint64_t unit)
+{
+    // splitmix64 finalizer
+    unit ^= unit >> 30;
+    unit *= 0xbf58476d1ce4e5b9ull;
+    unit ^= unit >> 27;
+    unit *= 0x94d049bb133111ebull;
+    unit ^= unit >> 31;
+
+    return unit >> (64 - REUSE_HASH_BITS);
+}
+
+static int
+cmp_entry_time(void const * a, void const * b)
+{
+    reuse_entry_t const * x = *(reuse_entry_t* const *) a;
+    reuse_entry_t const * y = *(reuse_entry_t* const *) b;
+
+    return (x->time > y->time) - (x->time < y->time);
+}
+
+static int
+cmp_u32(void const * a, void const * b)
+{
+    uint32_t const x = *(uint32_t const *) a;
+    uint32_t const y = *(uint32_t const *) b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Renumber the access times from 1, keeping their order, once they reach
+ * the end of the tree.
+ */
+static void
+tracker_compact(reuse_tracker_t* t)
+{
+    size_t const n = g_hash_table_size(t->units);
+    g_autofree reuse_entry_t** entries = g_new(reuse_entry_t*, n);
+
+    GHashTableIter it;
+    gpointer value;
+    size_t i = 0;
+
+    g_hash_table_iter_init(&it, t->units);
+    while (g_hash_table_iter_next(&it, NULL, &value))
+        entries[i++] = value;
+
+    qsort(entries, n, sizeof(*entries), cmp_entry_time);
+
+    memset(t->tree, 0, (max_time + 1) * sizeof(uint32_t));
+    for (i = 0; i < n; i++)
+    {
+        entries[i]->time = i + 1;
+        fenwick_add(t, i + 1, 1);
+    }
+
+    t->now = n;
+}
+
+static gboolean
+evict_above(gpointer key, gpointer value, gpointer userdata)
+{
+    reuse_tracker_t* t = userdata;
+    reuse_entry_t const * e = value;
+
+    if (e->hash < t->threshold)
+        return false;
+
+    fenwick_add(t, e->time, -1);
+    return true;
+}
+
+/**
+ * Scale the sample counts of a histogram taken at threshold `from' to
+ * threshold `to'.
+ */
+static void
+hist_rescale(reuse_hist_t* h, uint32_t from, uint32_t to)
+{
+    double const f = (double) to / from;
+
+    h->sampled  *= f;
+    h->cold     *= f;
+    h->distinct *= f;
+    for (unsigned int k = 0; k < REUSE_BINS; k++)
+        h->hist[k] *= f;
+}
+
+/**
+ * Add the counts of `h' to `sum', its samples scaled by `f'.
+ */
+static void
+hist_add(reuse_hist_t* sum, reuse_hist_t const * h, double f)
+{
+    sum->refs     += h->refs;
+    sum->sampled  += h->sampled * f;
+    sum->cold     += h->cold * f;
+    sum->distinct += h->distinct * f;
+    for (unsigned int k = 0; k < REUSE_BINS; k++)
+        sum->hist[k] += h->hist[k] * f;
+}
+
+/**
+ * Lower the threshold so that a quarter of the tracked units fall above it,
+ * and stop tracking them. They will never be sampled again.
+ */
+static void
+tracker_evict(reuse_tracker_t* t)
+{
+    size_t const n = g_hash_table_size(t->units);
+    g_autofree uint32_t* hashes = g_new(uint32_t, n);
+
+    GHashTableIter it;
+    gpointer value;
+    size_t i = 0;
+
+    g_hash_table_iter_init(&it, t->units);
+    while (g_hash_table_iter_next(&it, NULL, &value))
+        hashes[i++] = ((reuse_entry_t*) value)->hash;
+
+    qsort(hashes, n, sizeof(*hashes), cmp_u32);
+
+    uint32_t const threshold = MAX(hashes[max_entries * 3 / 4], 1);
+
+    hist_rescale(&t->interval, t->threshold, threshold);
+    hist_rescale(&t->total, t->threshold, threshold);
+
+    t->threshold = threshold;
+    g_hash_table_foreach_remove(t->units, evict_above, t);
+}
+
+static inline unsigned int
+distance_bin(uint64_t distance)
+{
+    return distance ? MIN(64 - clz64(distance), REUSE_BINS - 1) : 0;
+}
+
+static void
+tracker_access(reuse_tracker_t* t, uint64_t unit, uint32_t interval)
+{
+    t->interval.refs++;
+
+    uint32_t const hash = unit_hash(unit);
+    if (hash >= t->threshold)
+        return;
+
+    t->interval.sampled++;
+
+    if (t->now == max_time)
+        tracker_compact(t);
+
+    reuse_entry_t* e = g_hash_table_lookup(t->units, &unit);
+
+    if (e)
+    {
+        // Tracked units accessed since the last access to this one
+        uint64_t const distance = g_hash_table_size(t->units) - fenwick_sum(t, e->time);
+        t->interval.hist[distance_bin(distance * REUSE_HASH_RANGE / t->threshold)]++;
+
+        fenwick_add(t, e->time, -1);
+    }
+    else
+    {
+        e = g_new(reuse_entry_t, 1);
+        e->unit     = unit;
+        e->hash     = hash;
+        e->interval = UINT32_MAX;
+        g_hash_table_insert(t->units, &e->unit, e);
+
+        t->interval.cold++;
+    }
+
+    if (e->interval != interval)
+    {
+        e->interval = interval;
+        t->interval.distinct++;
+    }
+
+    e->time = ++t->now;
+    fenwick_add(t, e->time, 1);
+
+    if (g_hash_table_size(t->units) > max_entries)
+        tracker_evict(t);
+}
+
+// ─── Output ──────────────────────────────────────────────────────────────────
+
+/**
+ * Miss ratio of a cache of 2^k units.
+ */
+static inline double
+miss_ratio(reuse_hist_t const * h, unsigned int k)
+{
+    double misses = h->cold;
+
+    for (unsigned int j = k + 1; j < REUSE_BINS; j++)
+        misses += h->hist[j];
+
+    return h->sampled ? misses / h->sampled : 0.;
+}
+
+static void
+append_row(GString* out, size_t vcpu_index, uint64_t insns, reuse_stream_t s, reuse_unit_t u)
+{
+    reuse_tracker_t const * t = &vcpus[vcpu_index].tracker[s][u];
+    uint64_t const footprint = (uint64_t) (t->interval.distinct * REUSE_HASH_RANGE / t->threshold) << unit_bits[u];
+
+    g_string_append_printf(out, "%zu %u %" PRIu64 " %s %s %" PRIu64 " %" PRIu64,
+                           vcpu_index, vcpus[vcpu_index].n_interval, insns,
+                           stream_name[s], unit_name[u], t->interval.refs, footprint);
+
+    for (unsigned int k = 0; k < REUSE_BINS; k++)
+        g_string_append_printf(out, " %.4f", miss_ratio(&t->interval, k));
+
+    g_string_append_c(out, '\n');
+}
+
+static void
+output(GString const * out)
+{
+    g_mutex_lock(&lock);
+
+    if (file)
+        fputs(out->str, file);
+    else
+        qemu_plugin_outs(out->str);
+
+    g_mutex_unlock(&lock);
+}
+
+/**
+ * Write the curves of the current interval of a vCPU and start the next.
+ */
+static void
+end_interval(size_t vcpu_index, uint64_t insns)
+{
+    reuse_vcpu_t* v = &vcpus[vcpu_index];
+    g_autoptr(GString) out = g_string_new("");
+
+    for (reuse_stream_t s = 0; s < REUSE_STREAMS; s++)
+        for (reuse_unit_t u = 0; u < REUSE_UNITS; u++)
+        {
+            reuse_tracker_t* t = &v->tracker[s][u];
+
+            if (t->interval.refs)
+                append_row(out, vcpu_index, insns, s, u);
+
+            hist_add(&t->total, &t->interval, 1.);
+            memset(&t->interval, 0, sizeof(t->interval));
+        }
+
+    if (out->len)
+        output(out);
+
+    v->n_interval++;
+    v->next_insns = insns + interval_len;
+}
+
+// ─── Access ──────────────────────────────────────────────────────────────────
+
+static inline void
+reuse_access(reuse_vcpu_t* v, reuse_stream_t s, physical_address_t pa)
+{
+    for (reuse_unit_t u = 0; u < REUSE_UNITS; u++)
+        tracker_access(&v->tracker[s][u], pa >> unit_bits[u], v->n_interval);
+}
+
+void
+trace_reuse_access(unsigned int vcpu_index, memory_transaction_t const * tr)
+{
+    reuse_vcpu_t* v = &vcpus[vcpu_index];
+
+    if (tr->io)
+        return;
+
+    switch (tr->s.type)
+    {
+    case QEMU_Trans_Load:
+    case QEMU_Trans_Store:
+        reuse_access(v, REUSE_DATA, tr->s.physical_address);
+        break;
+
+    case QEMU_Trans_Instr_Fetch:
+        reuse_access(v, REUSE_INSN, tr->s.physical_address);
+        break;
+
+    case QEMU_Trans_Instr_Block:
+        // One fetch per instruction, as in trace-mode=insn
+        for (uint32_t i = 0; i < tr->block.n_insns; i++)
+            reuse_access(v, REUSE_INSN, tr->s.physical_address + i * sizeof(uint32_t));
+        break;
+
+    default:
+        return;
+    }
+
+    if (interval_len && (++v->refs & REUSE_CHECK_MASK) == 0)
+    {
+        uint64_t const insns = trace_count_get_insns(vcpu_index);
+
+        if (insns >= v->next_insns)
+            end_interval(vcpu_index, insns);
+    }
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_reuse_init(size_t nb_vcpus, char const * path, uint32_t rate, size_t entries, uint64_t interval)
+{
+    if (path && (file = fopen(path, "w")) == NULL)
+    {
+        error_report("ERROR: cannot create reuse-file %s: %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    n_vcpus      = nb_vcpus;
+    max_entries  = MAX(entries, 16);
+    max_time     = 2 * max_entries;
+    interval_len = interval;
+
+    vcpus = g_new0(reuse_vcpu_t, n_vcpus);
+
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        vcpus[i].next_insns = interval_len;
+
+        for (reuse_stream_t s = 0; s < REUSE_STREAMS; s++)
+            for (reuse_unit_t u = 0; u < REUSE_UNITS; u++)
+            {
+                reuse_tracker_t* t = &vcpus[i].tracker[s][u];
+
+                t->units     = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+                t->tree      = g_new0(uint32_t, max_time + 1);
+                t->threshold = REUSE_HASH_RANGE / MAX(rate, 1);
+            }
+    }
+
+    g_autoptr(GString) header = g_string_new("# vcpu interval insns stream unit refs footprint_bytes");
+    for (unsigned int k = 0; k < REUSE_BINS; k++)
+        g_string_append_printf(header, " miss_%u", k);
+    g_string_append_c(header, '\n');
+
+    output(header);
+}
+
+void
+trace_reuse_exit(void)
+{
+    if (vcpus == NULL)
+        return;
+
+    g_autoptr(GString) report = g_string_new("");
+
+    for (size_t i = 0; i < n_vcpus; i++)
+        end_interval(i, trace_count_get_insns(i));
+
+    // Whole run, each vCPU with a private cache
+    for (reuse_stream_t s = 0; s < REUSE_STREAMS; s++)
+        for (reuse_unit_t u = 0; u < REUSE_UNITS; u++)
+        {
+            // In references, the vCPUs may have ended at other thresholds
+            reuse_hist_t sum = {0};
+            uint64_t sampled = 0;
+            uint64_t footprint = 0;
+
+            for (size_t i = 0; i < n_vcpus; i++)
+            {
+                reuse_tracker_t const * t = &vcpus[i].tracker[s][u];
+
+                hist_add(&sum, &t->total, (double) REUSE_HASH_RANGE / t->threshold);
+                sampled += llround(t->total.sampled);
+
+                // Units under the final threshold were never dropped
+                footprint += (g_hash_table_size(t->units) * REUSE_HASH_RANGE / t->threshold) << unit_bits[u];
+            }
+
+            g_string_append_printf(report, "> REUSE[%s %s] REFS: %" PRIu64 " SAMPLED: %" PRIu64
+                                           " FOOTPRINT_MBYTES: %f MISS:",
+                                   stream_name[s], unit_name[u], sum.refs, sampled, footprint / 1e6);
+
+            for (unsigned int k = 0; k < REUSE_BINS; k++)
+                g_string_append_printf(report, " %.4f", miss_ratio(&sum, k));
+
+            g_string_append_c(report, '\n');
+        }
+
+    qemu_plugin_outs(report->str);
+
+    for (size_t i = 0; i < n_vcpus; i++)
+        for (reuse_stream_t s = 0; s < REUSE_STREAMS; s++)
+            for (reuse_unit_t u = 0; u < REUSE_UNITS; u++)
+            {
+                g_hash_table_destroy(vcpus[i].tracker[s][u].units);
+                g_free(vcpus[i].tracker[s][u].tree);
+            }
+
+    g_free(vcpus);
+    vcpus = NULL;
+
+    if (file)
+    {
+        fclose(file);
+        file = NULL;
+    }
+}
@@ -0,0 +1,325 @@
+/*
+ * Per-vCPU single-producer/single-consumer rings between the trace
+ * callbacks and Flexus.
+ *
+ * Each vCPU thread appends memory_transaction_t records to its own ring,
+ * while a small pool of consumer threads drains the rings in batches into
+ * Flexus. Guest execution and timing-model work then overlap instead of
+ * stalling every vCPU on `flexus_api.trace_mem`.
+ *
+ * With trace-encoding=compact a ring holds bytes of encoded events instead
+ * (see trace-codec.h), and the consumer decodes them back into a batch.
+ * An event never wraps around the end of the buffer, the producer skips
+ * the tail of the buffer with a TRACE_CODEC_PAD byte instead.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/units.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "middleware/libqflex/libqflex-module.h"
+#include "trace.h"
+#include "trace-codec.h"
+
+// Maximum number of events handed to Flexus per drain of a ring
+#define RING_BATCH_MAX     (4096)
+// Consumer spin rounds on empty rings before going to sleep
+#define RING_IDLE_SPIN     (64)
+#define RING_IDLE_SLEEP_US (50)
+// Bytes of a compact ring per event of `ring-size', and lower bound
+#define RING_COMPACT_EVENT_BYTES (16)
+#define RING_COMPACT_MIN_BYTES   (64 * KiB)
+
+typedef struct
+{
+    // Events, or bytes of encoded events for compact rings
+    memory_transaction_t*   buffer;
+    uint8_t*                bytes;
+    uint64_t                mask;
+
+    // Producer side (vCPU thread), on its own cache line
+    uint64_t                head        __attribute__((aligned(64)));
+    uint64_t                tail_cache;
+    trace_codec_t*          encoder;
+
+    // Consumer side, on its own cache line
+    uint64_t                tail        __attribute__((aligned(64)));
+    trace_codec_t*          decoder;
+
+} trace_ring_t;
+
+typedef struct
+{
+    size_t      index;
+    GThread*    thread;
+    // Decoded events of compact rings
+    memory_transaction_t*   batch;
+} ring_consumer_t;
+
+static trace_ring_t*    rings = NULL;
+static size_t           n_rings = 0;
+
+static ring_consumer_t* consumers = NULL;
+static size_t           n_consumers = 0;
+
+static bool             stop_consumers = false;
+static bool             compact = false;
+
+// Set when Flexus negotiated an interface with batched delivery
+static FLEXUS_TRACE_MEM_BATCH_t trace_mem_batch = NULL;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+/**
+ * Hand the contiguous part of a ring to Flexus, in a single call when
+ * the library implements `trace_mem_batch'.
+ *
+ * @return The number of events consumed.
+ */
+static size_t
+ring_consume(size_t vcpu_index, trace_ring_t* ring)
+{
+    uint64_t head = qatomic_load_acquire(&ring->head);
+    uint64_t tail = ring->tail;
+
+    if (head == tail)
+        return 0;
+
+    uint64_t start = tail & ring->mask;
+    uint64_t n = MIN(head - tail, ring->mask + 1 - start);
+    n = MIN(n, RING_BATCH_MAX);
+
+    if (trace_mem_batch)
+        trace_mem_batch(vcpu_index, &ring->buffer[start], n);
+    else
+        for (uint64_t i = 0; i < n; i++)
+            flexus_api.trace_mem(vcpu_index, &ring->buffer[start + i]);
+
+    // Slots are handed back to the producer only once Flexus is done with them
+    qatomic_store_release(&ring->tail, tail + n);
+    return n;
+}
+
+/**
+ * Decode the pending events of a compact ring and hand them to Flexus.
+ * Block opcodes point into the ring, which is only released afterwards.
+ *
+ * @return The number of events consumed.
+ */
+static size_t
+ring_consume_compact(ring_consumer_t* self, size_t vcpu_index, trace_ring_t* ring)
+{
+    uint64_t head = qatomic_load_acquire(&ring->head);
+    uint64_t tail = ring->tail;
+    size_t n = 0;
+
+    while (tail != head && n < RING_BATCH_MAX)
+    {
+        uint64_t const pos = tail & ring->mask;
+
+        if (ring->bytes[pos] == TRACE_CODEC_PAD)
+        {
+            tail += ring->mask + 1 - pos;
+            continue;
+        }
+
+        tail += trace_codec_decode(ring->decoder, &ring->bytes[pos], &self->batch[n++]);
+    }
+
+    if (n && trace_mem_batch)
+        trace_mem_batch(vcpu_index, self->batch, n);
+    else
+        for (size_t i = 0; i < n; i++)
+            flexus_api.trace_mem(vcpu_index, &self->batch[i]);
+
+    qatomic_store_release(&ring->tail, tail);
+    return n;
+}
+
+/**
+ * Consumer loop. Consumer `c` owns every ring `r` such that r % n_consumers == c,
+ * so each ring keeps a single consumer and events of a vCPU stay in order.
+ */
+static gpointer
+ring_consumer_loop(gpointer opaque)
+{
+    ring_consumer_t* self = opaque;
+    size_t idle = 0;
+
+    while (true)
+    {
+        size_t consumed = 0;
+
+        for (size_t r = self->index; r < n_rings; r += n_consumers)
+            consumed += compact
+                ? ring_consume_compact(self, r, &rings[r])
+                : ring_consume(r, &rings[r]);
+
+        if (consumed)
+        {
+            idle = 0;
+            continue;
+        }
+
+        // Stop only once every owned ring has been emptied
+        if (qatomic_read(&stop_consumers))
+            break;
+
+        if (++idle < RING_IDLE_SPIN)
+            continue;
+
+        g_usleep(RING_IDLE_SLEEP_US);
+    }
+
+    return NULL;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_ring_init(size_t n_vcpus, size_t ring_size, size_t nb_consumers)
+{
+    g_assert(n_vcpus > 0);
+    g_assert(is_power_of_2(ring_size));
+
+    if (qemu_libqflex_state.api_version >= 2)
+        trace_mem_batch = flexus_api.trace_mem_batch;
+
+    compact = (qemu_libqflex_state.trace_encoding == TRACE_ENCODING_COMPACT);
+
+    n_rings = n_vcpus;
+    rings = g_new0(trace_ring_t, n_rings);
+
+    for (size_t i = 0; i < n_rings; i++)
+    {
+        if (compact)
+        {
+            size_t const bytes = MAX(ring_size * RING_COMPACT_EVENT_BYTES, RING_COMPACT_MIN_BYTES);
+
+            rings[i].bytes   = g_malloc(bytes);
+            rings[i].mask    = bytes - 1;
+            rings[i].encoder = g_new0(trace_codec_t, 1);
+            rings[i].decoder = g_new0(trace_codec_t, 1);
+            trace_codec_reset(rings[i].encoder);
+            trace_codec_reset(rings[i].decoder);
+            continue;
+        }
+
+        rings[i].buffer = g_new(memory_transaction_t, ring_size);
+        rings[i].mask   = ring_size - 1;
+    }
+
+    // Default to one consumer per vCPU, never more
+    n_consumers = (nb_consumers == 0 || nb_consumers > n_vcpus) ? n_vcpus : nb_consumers;
+    consumers = g_new0(ring_consumer_t, n_consumers);
+
+    for (size_t i = 0; i < n_consumers; i++)
+    {
+        g_autofree char* name = g_strdup_printf("qflex-ring-%zu", i);
+
+        consumers[i].index  = i;
+        consumers[i].batch  = compact ? g_new(memory_transaction_t, RING_BATCH_MAX) : NULL;
+        consumers[i].thread = g_thread_new(name, ring_consumer_loop, &consumers[i]);
+    }
+}
+
+/**
+ * Wait until `size' bytes past `head' are free in a ring.
+ */
+static inline void
+ring_reserve(trace_ring_t* ring, uint64_t head, uint64_t size)
+{
+    while (head + size - ring->tail_cache > ring->mask + 1)
+    {
+        ring->tail_cache = qatomic_load_acquire(&ring->tail);
+        if (head + size - ring->tail_cache > ring->mask + 1)
+            g_thread_yield();
+    }
+}
+
+static void
+trace_ring_push_compact(trace_ring_t* ring, memory_transaction_t const * tr)
+{
+    uint64_t head = ring->head;
+    uint64_t const left = ring->mask + 1 - (head & ring->mask);
+
+    // Not enough room before the end for the largest event, skip to the start
+    if (left < TRACE_CODEC_MAX_EVENT)
+    {
+        ring_reserve(ring, head, left);
+        ring->bytes[head & ring->mask] = TRACE_CODEC_PAD;
+        head += left;
+    }
+
+    ring_reserve(ring, head, TRACE_CODEC_MAX_EVENT);
+    head += trace_codec_encode(ring->encoder, tr, &ring->bytes[head & ring->mask]);
+
+    qatomic_store_release(&ring->head, head);
+}
+
+void
+trace_ring_push(unsigned int vcpu_index, memory_transaction_t const * tr)
+{
+    trace_ring_t* ring = &rings[vcpu_index];
+
+    if (compact)
+    {
+        trace_ring_push_compact(ring, tr);
+        return;
+    }
+
+    uint64_t head = ring->head;
+
+    // Full from the cached point of view, refresh the consumer position
+    while (head - ring->tail_cache > ring->mask)
+    {
+        ring->tail_cache = qatomic_load_acquire(&ring->tail);
+        if (head - ring->tail_cache > ring->mask)
+            g_thread_yield();
+    }
+
+    ring->buffer[head & ring->mask] = *tr;
+    qatomic_store_release(&ring->head, head + 1);
+}
+
+void
+trace_ring_drain(void)
+{
+    for (size_t i = 0; i < n_rings; i++)
+        while (qatomic_load_acquire(&rings[i].tail) != qatomic_read(&rings[i].head))
+            g_thread_yield();
+}
+
+void
+trace_ring_exit(void)
+{
+    if (rings == NULL)
+        return;
+
+    qatomic_set(&stop_consumers, true);
+
+    for (size_t i = 0; i < n_consumers; i++)
+        g_thread_join(consumers[i].thread);
+
+    for (size_t i = 0; i < n_consumers; i++)
+        g_free(consumers[i].batch);
+
+    for (size_t i = 0; i < n_rings; i++)
+    {
+        g_free(rings[i].buffer);
+        g_free(rings[i].bytes);
+        g_free(rings[i].encoder);
+        g_free(rings[i].decoder);
+    }
+
+    g_free(consumers);
+    g_free(rings);
+
+    consumers = NULL;
+    rings = NULL;
+}
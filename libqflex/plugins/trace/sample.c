@@ -0,0 +1,180 @@
+/*
+ * Periodic sampling (SMARTS-style) schedule of the trace plugin.
+ *
+ * The guest runs `sample-skip' instructions uninstrumented, then
+ * `sample-warm' instructions of warming and `sample-detail' instructions of
+ * detailed tracing, and repeats. Lengths count instructions of all vCPUs.
+ *
+ * Every block carries an inline instruction counter and a conditional
+ * callback firing once a vCPU went through a quantum of instructions, so
+ * progress is tracked without a helper call per block. Switching between
+ * instrumented and uninstrumented code flushes the translation blocks;
+ * warming and detailed phases share the same instrumentation and Flexus is
+ * only told about the change.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/log.h"
+
+#include "qemu/qemu-plugin.h"
+#include "exec/tb-flush.h"
+#include "hw/core/cpu.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "middleware/libqflex/libqflex-module.h"
+#include "trace.h"
+
+// Upper bound on the per-vCPU quantum, in instructions
+#define SAMPLE_QUANTUM_MAX (1 << 20)
+
+static bool enabled = false;
+
+static uint64_t phase_len[QEMU_Sample_Phase_Count];
+static sample_phase_t phase = QEMU_Sample_Skip;
+
+// Instructions of the current phase, aggregated from every vCPU quanta
+static uint64_t phase_insns = 0;
+static uint64_t n_samples = 0;
+static uint64_t n_flushes = 0;
+
+static GMutex lock;
+
+static struct qemu_plugin_scoreboard* since = NULL;
+static qemu_plugin_u64 since_insns;
+static uint64_t quantum = 0;
+
+static char const * const phase_name[QEMU_Sample_Phase_Count] = {
+    [QEMU_Sample_Skip]   = "skip",
+    [QEMU_Sample_Warm]   = "warm",
+    [QEMU_Sample_Detail] = "detail",
+};
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+static sample_phase_t
+next_phase(sample_phase_t p)
+{
+    do {
+        p = (p + 1) % QEMU_Sample_Phase_Count;
+    } while (phase_len[p] == 0);
+
+    return p;
+}
+
+/**
+ * Move to the next phase of the schedule. Called with `lock' held, from the
+ * vCPU thread that completed the phase.
+ */
+static void
+switch_phase(void)
+{
+    sample_phase_t const prev = phase;
+    sample_phase_t const next = next_phase(prev);
+
+    if (next == QEMU_Sample_Detail)
+        n_samples++;
+
+    qatomic_set(&phase, next);
+    phase_insns = 0;
+
+    qemu_log_mask(CPU_LOG_PLUGIN, "> [Libqflex] Sample phase: %s -> %s\n",
+                  phase_name[prev], phase_name[next]);
+
+    // Flexus receives no events while skipping, it just has to know whether
+    // the coming ones are for warming or for measurement
+    if (qemu_libqflex_state.api_version >= 5 && !trace_order_sample_phase(next))
+        flexus_api.sample_phase(next);
+
+    /**
+     * Blocks translated from now on pick the new instrumentation, older ones
+     * are thrown away as soon as every vCPU leaves the generated code.
+     */
+    if ((prev == QEMU_Sample_Skip) != (next == QEMU_Sample_Skip))
+    {
+        n_flushes++;
+        tb_flush(current_cpu);
+    }
+}
+
+/**
+ * Called when a vCPU went through at least one quantum of instructions.
+ */
+static void
+dispatch_quantum(unsigned int vcpu_index, void* userdata)
+{
+    uint64_t const n = qemu_plugin_u64_get(since_insns, vcpu_index);
+    qemu_plugin_u64_set(since_insns, vcpu_index, 0);
+
+    g_mutex_lock(&lock);
+
+    phase_insns += n;
+    if (phase_insns >= phase_len[phase])
+        switch_phase();
+
+    g_mutex_unlock(&lock);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_sample_init(size_t n_vcpus, uint64_t skip, uint64_t warm, uint64_t detail)
+{
+    if (!skip && !warm)
+        return;
+
+    phase_len[QEMU_Sample_Skip]   = skip;
+    phase_len[QEMU_Sample_Warm]   = warm;
+    phase_len[QEMU_Sample_Detail] = detail;
+
+    // Without a detailed phase there would be nothing to measure
+    g_assert(detail > 0);
+
+    uint64_t shortest = detail;
+    if (skip) shortest = MIN(shortest, skip);
+    if (warm) shortest = MIN(shortest, warm);
+
+    // Check a few times per phase and per vCPU
+    quantum = MIN(MAX(shortest / (4 * n_vcpus), 1), SAMPLE_QUANTUM_MAX);
+
+    since = qemu_plugin_scoreboard_new(sizeof(uint64_t));
+    since_insns = qemu_plugin_scoreboard_u64(since);
+
+    phase = skip ? QEMU_Sample_Skip : QEMU_Sample_Warm;
+    enabled = true;
+
+    qemu_log("> [Libqflex] SAMPLE       =skip:%" PRIu64 " warm:%" PRIu64 " detail:%" PRIu64 " quantum:%" PRIu64 "\n",
+             skip, warm, detail, quantum);
+}
+
+bool
+trace_sample_register(struct qemu_plugin_tb* tb)
+{
+    if (!enabled)
+        return true;
+
+    qemu_plugin_register_vcpu_tb_exec_inline_per_vcpu(
+        tb, QEMU_PLUGIN_INLINE_ADD_U64, since_insns, qemu_plugin_tb_n_insns(tb));
+
+    qemu_plugin_register_vcpu_tb_exec_cond_cb(
+        tb, dispatch_quantum, QEMU_PLUGIN_CB_NO_REGS,
+        QEMU_PLUGIN_COND_GE, since_insns, quantum, NULL);
+
+    return qatomic_read(&phase) != QEMU_Sample_Skip;
+}
+
+void
+trace_sample_report(void)
+{
+    if (!enabled)
+        return;
+
+    g_autofree char* report = g_strdup_printf(
+        "> SAMPLES: %" PRIu64 " (phase: %s, flushes: %" PRIu64 ")\n",
+        n_samples, phase_name[phase], n_flushes);
+
+    qemu_plugin_outs(report);
+}
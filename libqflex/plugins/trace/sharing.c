@@ -0,0 +1,302 @@
+/*
+ * Online false sharing and coherence hotspot detector (trace-sink=sharing).
+ *
+ * Follows every data access through a simplified invalidation protocol per
+ * 64 bytes physical line: a write makes the writer the owner and the only
+ * sharer, a read adds a sharer. An access by a vCPU which does not hold the
+ * line while another vCPU wrote it is a coherence transfer. It is counted
+ * as true sharing when it touches bytes the owner wrote, and as false
+ * sharing when it only shares the line with them.
+ *
+ * Lines live in a fixed size set associative table, `sharing-lines' lines,
+ * each set under a spinlock. A new line takes the place of the least
+ * contended one of its set, so that lines touched by a single vCPU make way
+ * and hot lines stay. vCPU sets are bitmasks of the first 64 vCPUs, further
+ * vCPUs are folded onto them.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/thread.h"
+
+#include "qemu/qemu-plugin.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "trace.h"
+
+#define SHARING_LINE_BITS   (6)
+#define SHARING_LINE_BYTES  (1 << SHARING_LINE_BITS)
+#define SHARING_WAYS        (4)
+// Instructions remembered per line, the most frequent ones stay
+#define SHARING_PCS         (4)
+
+typedef struct
+{
+    logical_address_t   pc;
+    uint32_t            count;
+    uint16_t            vcpu;
+    bool                is_store;
+} sharing_pc_t;
+
+typedef struct
+{
+    // Physical line number + 1, 0 when free
+    uint64_t        line;
+
+    uint64_t        readers;
+    uint64_t        writers;
+    // vCPUs holding a valid copy
+    uint64_t        sharers;
+    // Bytes written by the owner since it took the line
+    uint64_t        dirty;
+    // Last writer + 1, 0 for none
+    uint32_t        owner;
+
+    uint32_t        transfers;
+    uint32_t        invalidations;
+    uint32_t        true_sharing;
+    uint32_t        false_sharing;
+
+    sharing_pc_t    pcs[SHARING_PCS];
+
+} sharing_line_t;
+
+typedef struct
+{
+    QemuSpin        lock;
+    sharing_line_t  ways[SHARING_WAYS];
+} __attribute__((aligned(64))) sharing_set_t;
+
+static sharing_set_t* sets = NULL;
+static uint64_t set_mask = 0;
+// Lines printed at exit
+static size_t report_top = 0;
+
+// Per vCPU, summed when dumped
+static struct qemu_plugin_scoreboard* accesses = NULL;
+static qemu_plugin_u64 n_accesses;
+static uint64_t n_evictions = 0;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+static inline sharing_set_t*
+set_of(uint64_t line)
+{
+    return &sets[(line * 0x9E3779B97F4A7C15ull >> 32) & set_mask];
+}
+
+/**
+ * Bytes of the line an access touches, `size' is log2 of its width as
+ * decoded (MemOp size).
+ */
+static inline uint64_t
+byte_mask(uint64_t offset, uint64_t size)
+{
+    uint64_t const n = MIN(1ull << MIN(size, 6), SHARING_LINE_BYTES - offset);
+    return (n >= 64 ? UINT64_MAX : ((1ull << n) - 1)) << offset;
+}
+
+/**
+ * Line of `line' in its set, taking the place of the least contended one
+ * when it is not there. The set lock must be held.
+ */
+static sharing_line_t*
+set_find(sharing_set_t* set, uint64_t line)
+{
+    sharing_line_t* victim = &set->ways[0];
+
+    for (size_t w = 0; w < SHARING_WAYS; w++)
+    {
+        sharing_line_t* l = &set->ways[w];
+
+        if (l->line == line + 1)
+            return l;
+
+        if (l->line == 0 || (victim->line && l->transfers < victim->transfers))
+            victim = l;
+    }
+
+    if (victim->line)
+        qatomic_inc(&n_evictions);
+
+    memset(victim, 0, sizeof(*victim));
+    victim->line = line + 1;
+
+    return victim;
+}
+
+static void
+line_record_pc(sharing_line_t* l, unsigned int vcpu_index, logical_address_t pc, bool is_store)
+{
+    sharing_pc_t* victim = &l->pcs[0];
+
+    for (size_t i = 0; i < SHARING_PCS; i++)
+    {
+        sharing_pc_t* p = &l->pcs[i];
+
+        if (p->count && p->pc == pc && p->vcpu == vcpu_index)
+        {
+            p->count++;
+            p->is_store |= is_store;
+            return;
+        }
+
+        if (p->count < victim->count)
+            victim = p;
+    }
+
+    // Replaced entries leave their count, so that a newcomer has to earn its place
+    victim->pc       = pc;
+    victim->vcpu     = vcpu_index;
+    victim->is_store = is_store;
+    victim->count++;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_sharing_init(size_t n_lines, size_t top)
+{
+    report_top = top;
+
+    size_t const n_sets = pow2ceil(MAX(n_lines / SHARING_WAYS, 1));
+
+    sets = g_new0(sharing_set_t, n_sets);
+    set_mask = n_sets - 1;
+
+    for (size_t i = 0; i < n_sets; i++)
+        qemu_spin_init(&sets[i].lock);
+
+    accesses = qemu_plugin_scoreboard_new(sizeof(uint64_t));
+    n_accesses = qemu_plugin_scoreboard_u64(accesses);
+}
+
+void
+trace_sharing_access(unsigned int vcpu_index, memory_transaction_t const * tr)
+{
+    if (tr->io || (tr->s.type != QEMU_Trans_Load && tr->s.type != QEMU_Trans_Store))
+        return;
+
+    bool const is_store = (tr->s.type == QEMU_Trans_Store);
+    uint64_t const line = tr->s.physical_address >> SHARING_LINE_BITS;
+    uint64_t const bytes = byte_mask(tr->s.physical_address & (SHARING_LINE_BYTES - 1), tr->s.size);
+    uint64_t const self = 1ull << (vcpu_index % 64);
+
+    sharing_set_t* set = set_of(line);
+
+    qemu_spin_lock(&set->lock);
+
+    sharing_line_t* l = set_find(set, line);
+
+    // Another vCPU wrote the line since this one last held it
+    if (!(l->sharers & self) && l->owner && l->owner != vcpu_index + 1)
+    {
+        l->transfers++;
+
+        if (l->dirty & bytes)
+            l->true_sharing++;
+        else
+            l->false_sharing++;
+
+        line_record_pc(l, vcpu_index, tr->s.pc, is_store);
+    }
+
+    if (is_store)
+    {
+        if (l->sharers & ~self)
+        {
+            l->invalidations += ctpop64(l->sharers & ~self);
+            line_record_pc(l, vcpu_index, tr->s.pc, is_store);
+        }
+
+        l->dirty    = (l->owner == vcpu_index + 1) ? (l->dirty | bytes) : bytes;
+        l->owner    = vcpu_index + 1;
+        l->sharers  = self;
+        l->writers |= self;
+    }
+    else
+    {
+        l->sharers |= self;
+        l->readers |= self;
+    }
+
+    qemu_spin_unlock(&set->lock);
+
+    qemu_plugin_u64_add(n_accesses, vcpu_index, 1);
+}
+
+static int
+cmp_contention(void const * a, void const * b)
+{
+    sharing_line_t const * x = a;
+    sharing_line_t const * y = b;
+    uint64_t const cx = (uint64_t) x->transfers + x->invalidations;
+    uint64_t const cy = (uint64_t) y->transfers + y->invalidations;
+
+    return (cx < cy) - (cx > cy);
+}
+
+void
+trace_sharing_dump(GString* out, size_t top)
+{
+    if (sets == NULL)
+        return;
+
+    g_autoptr(GArray) hot = g_array_new(false, false, sizeof(sharing_line_t));
+
+    // Only lines that went from one vCPU to another
+    for (size_t i = 0; i <= set_mask; i++)
+    {
+        qemu_spin_lock(&sets[i].lock);
+
+        for (size_t w = 0; w < SHARING_WAYS; w++)
+            if (sets[i].ways[w].transfers || sets[i].ways[w].invalidations)
+                g_array_append_val(hot, sets[i].ways[w]);
+
+        qemu_spin_unlock(&sets[i].lock);
+    }
+
+    g_array_sort(hot, cmp_contention);
+
+    g_string_append_printf(out, "> SHARING: %" PRIu64 " accesses, %u contended lines, %" PRIu64 " evictions\n",
+                           qemu_plugin_u64_sum(n_accesses), hot->len, qatomic_read(&n_evictions));
+
+    for (size_t i = 0; i < MIN(top, hot->len); i++)
+    {
+        sharing_line_t const * l = &g_array_index(hot, sharing_line_t, i);
+
+        g_string_append_printf(out,
+            "> SHARING[%zu] PA: 0x%" PRIx64 " %s TRANSFERS: %u INVALIDATIONS: %u TRUE: %u FALSE: %u"
+            " READERS: 0x%" PRIx64 " WRITERS: 0x%" PRIx64 " PCS:",
+            i, (l->line - 1) << SHARING_LINE_BITS,
+            (l->false_sharing > l->true_sharing) ? "false-sharing" : "true-sharing",
+            l->transfers, l->invalidations, l->true_sharing, l->false_sharing,
+            l->readers, l->writers);
+
+        for (size_t p = 0; p < SHARING_PCS; p++)
+            if (l->pcs[p].count)
+                g_string_append_printf(out, " CPU%u:0x%" PRIx64 ":%s:%u",
+                                       l->pcs[p].vcpu, l->pcs[p].pc,
+                                       l->pcs[p].is_store ? "W" : "R", l->pcs[p].count);
+
+        g_string_append_c(out, '\n');
+    }
+}
+
+void
+trace_sharing_exit(void)
+{
+    if (sets == NULL)
+        return;
+
+    g_autoptr(GString) report = g_string_new("");
+
+    trace_sharing_dump(report, report_top);
+    qemu_plugin_outs(report->str);
+
+    g_free(sets);
+    sets = NULL;
+}
@@ -0,0 +1,326 @@
+/*
+ * Consumers of the trace events.
+ *
+ * The sinks picked with -libqflex trace-sink are started with the plugin,
+ * and every event goes through `trace_sink_emit'. With a single sink it
+ * points straight to the emit function of that sink, so that the dispatch
+ * path has no test at all; only several sinks go through a loop.
+ *
+ *  - flexus: flexus_api.trace_mem, the per-vCPU rings with ring-size, or
+ *            the deterministic merge with trace-order
+ *  - file:   the trace file, see trace-file.c
+ *  - stats:  per-vCPU counts of the delivered events
+ *  - null:   drops everything, to measure the instrumentation alone
+ *  - reuse:  reuse distance profiler, see reuse.c
+ *  - sharing: false sharing and coherence hotspots, see sharing.c
+ *  - lock:   lock contention of the exclusive and atomic accesses, see lock.c
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/log.h"
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "middleware/libqflex/libqflex-module.h"
+#include "trace.h"
+
+typedef struct
+{
+    uint32_t        mask;
+    char const *    name;
+
+    // Start the sink, return the function receiving its events
+    trace_emit_fn (*init)(void);
+    // On TB flush, before the translation records are reclaimed
+    void (*flush)(void);
+    void (*exit)(void);
+
+} trace_sink_t;
+
+typedef struct
+{
+    uint64_t events[QEMU_Trans_Instr_Block + 1];
+    uint64_t insns;
+    uint64_t io;
+} __attribute__((aligned(64))) sink_stats_t;
+
+trace_emit_fn trace_sink_emit = NULL;
+
+static trace_sink_t const * active[TRACE_SINK_COUNT];
+static trace_emit_fn active_emit[TRACE_SINK_COUNT];
+static size_t n_active = 0;
+
+static sink_stats_t* stats = NULL;
+
+// ─── Flexus ──────────────────────────────────────────────────────────────────
+
+static bool use_rings = false;
+
+static void
+flexus_emit(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+    flexus_api.trace_mem(vcpu_index, tr);
+}
+
+static void
+flexus_ring_emit(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+    trace_ring_push(vcpu_index, tr);
+}
+
+static void
+flexus_order_emit(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+    trace_order_push(vcpu_index, tr);
+}
+
+static trace_emit_fn
+flexus_init(void)
+{
+    if (qemu_libqflex_state.trace_mode == TRACE_MODE_BLOCK &&
+        qemu_libqflex_state.api_version < 3)
+    {
+        error_report("ERROR: trace-mode=block needs a Flexus with API version 3 or more (got %u)",
+                     qemu_libqflex_state.api_version);
+        exit(EXIT_FAILURE);
+    }
+
+    if (qemu_libqflex_state.trace_order)
+    {
+        trace_order_init(qemu_libqflex_state.n_vcpus, qemu_libqflex_state.order_quantum);
+        return flexus_order_emit;
+    }
+
+    if (!qemu_libqflex_state.ring_size)
+        return flexus_emit;
+
+    trace_ring_init(
+        qemu_libqflex_state.n_vcpus,
+        qemu_libqflex_state.ring_size,
+        qemu_libqflex_state.ring_consumers);
+    use_rings = true;
+
+    return flexus_ring_emit;
+}
+
+static void
+flexus_flush(void)
+{
+    // Block events in flight point to opcodes stored in the arenas
+    if (use_rings)
+        trace_ring_drain();
+}
+
+static void
+flexus_exit(void)
+{
+    trace_order_exit();
+    trace_ring_exit();
+}
+
+// ─── File ────────────────────────────────────────────────────────────────────
+
+static void
+file_emit(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+    trace_file_write(vcpu_index, tr);
+}
+
+static trace_emit_fn
+file_init(void)
+{
+    trace_file_init(
+        qemu_libqflex_state.trace_file,
+        qemu_libqflex_state.n_vcpus,
+        qemu_libqflex_state.trace_file_chunk);
+
+    return file_emit;
+}
+
+// ─── Stats ───────────────────────────────────────────────────────────────────
+
+static void
+stats_emit(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+    sink_stats_t* s = &stats[vcpu_index];
+
+    if (tr->s.type <= QEMU_Trans_Instr_Block)
+        s->events[tr->s.type]++;
+
+    if (tr->s.type == QEMU_Trans_Instr_Block)
+        s->insns += tr->block.n_insns;
+    else if (tr->s.type == QEMU_Trans_Instr_Fetch)
+        s->insns++;
+
+    s->io += tr->io;
+}
+
+static trace_emit_fn
+stats_init(void)
+{
+    stats = g_new0(sink_stats_t, qemu_libqflex_state.n_vcpus);
+    return stats_emit;
+}
+
+static void
+stats_exit(void)
+{
+    g_autoptr(GString) report = g_string_new("");
+
+    for (size_t i = 0; i < qemu_libqflex_state.n_vcpus; i++)
+        g_string_append_printf(report,
+            "> SINK_STATS[%zu] FETCH: %" PRIu64 " LOAD: %" PRIu64 " STORE: %" PRIu64
+            " BLOCK: %" PRIu64 " INSNS: %" PRIu64 " IO: %" PRIu64 "\n",
+            i,
+            stats[i].events[QEMU_Trans_Instr_Fetch],
+            stats[i].events[QEMU_Trans_Load],
+            stats[i].events[QEMU_Trans_Store],
+            stats[i].events[QEMU_Trans_Instr_Block],
+            stats[i].insns, stats[i].io);
+
+    qemu_plugin_outs(report->str);
+
+    g_free(stats);
+    stats = NULL;
+}
+
+// ─── Null ────────────────────────────────────────────────────────────────────
+
+static void
+null_emit(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+}
+
+static trace_emit_fn
+null_init(void)
+{
+    return null_emit;
+}
+
+// ─── Reuse ───────────────────────────────────────────────────────────────────
+
+static void
+reuse_emit(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+    trace_reuse_access(vcpu_index, tr);
+}
+
+static trace_emit_fn
+reuse_init(void)
+{
+    trace_reuse_init(
+        qemu_libqflex_state.n_vcpus,
+        qemu_libqflex_state.reuse_file,
+        qemu_libqflex_state.reuse_rate,
+        qemu_libqflex_state.reuse_entries,
+        qemu_libqflex_state.reuse_interval);
+
+    return reuse_emit;
+}
+
+// ─── Sharing ─────────────────────────────────────────────────────────────────
+
+static void
+sharing_emit(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+    trace_sharing_access(vcpu_index, tr);
+}
+
+static trace_emit_fn
+sharing_init(void)
+{
+    trace_sharing_init(
+        qemu_libqflex_state.sharing_lines,
+        qemu_libqflex_state.sharing_top);
+
+    return sharing_emit;
+}
+
+// ─── Lock ────────────────────────────────────────────────────────────────────
+
+static void
+lock_emit(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+    trace_lock_access(vcpu_index, tr);
+}
+
+static trace_emit_fn
+lock_init(void)
+{
+    trace_lock_init(
+        qemu_libqflex_state.n_vcpus,
+        qemu_libqflex_state.lock_top);
+
+    return lock_emit;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+static trace_sink_t const sinks[TRACE_SINK_COUNT] = {
+    { TRACE_SINK_FLEXUS, "flexus", flexus_init, flexus_flush, flexus_exit      },
+    { TRACE_SINK_FILE,   "file",   file_init,   NULL,         trace_file_close },
+    { TRACE_SINK_STATS,  "stats",  stats_init,  NULL,         stats_exit       },
+    { TRACE_SINK_NULL,   "null",   null_init,   NULL,         NULL             },
+    { TRACE_SINK_REUSE,  "reuse",  reuse_init,  NULL,         trace_reuse_exit },
+    { TRACE_SINK_SHARING, "sharing", sharing_init, NULL,      trace_sharing_exit },
+    { TRACE_SINK_LOCK,   "lock",   lock_init,   NULL,         trace_lock_exit  },
+};
+
+/**
+ * Emit to every active sink, only used with more than one.
+ */
+static void
+emit_all(unsigned int vcpu_index, memory_transaction_t* tr)
+{
+    for (size_t i = 0; i < n_active; i++)
+        active_emit[i](vcpu_index, tr);
+}
+
+uint32_t
+trace_sink_parse(char const * name)
+{
+    for (size_t i = 0; i < TRACE_SINK_COUNT; i++)
+        if (strcmp(sinks[i].name, name) == 0)
+            return sinks[i].mask;
+
+    return 0;
+}
+
+void
+trace_sink_init(uint32_t mask)
+{
+    for (size_t i = 0; i < TRACE_SINK_COUNT; i++)
+    {
+        if (!(mask & sinks[i].mask))
+            continue;
+
+        active_emit[n_active] = sinks[i].init();
+        active[n_active++] = &sinks[i];
+        qemu_log("> [Libqflex] TRACE_SINK   =%s\n", sinks[i].name);
+    }
+
+    g_assert(n_active > 0);
+
+    trace_sink_emit = (n_active == 1) ? active_emit[0] : emit_all;
+}
+
+void
+trace_sink_flush(void)
+{
+    for (size_t i = 0; i < n_active; i++)
+        if (active[i]->flush)
+            active[i]->flush();
+}
+
+void
+trace_sink_exit(void)
+{
+    for (size_t i = 0; i < n_active; i++)
+        if (active[i]->exit)
+            active[i]->exit();
+
+    n_active = 0;
+}
@@ -0,0 +1,512 @@
+/*
+ * Compact encoding of the trace events, see trace-codec.h.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "trace-codec.h"
+
+// Tag byte
+#define TAG_TYPE_MASK   (0x07)
+#define TAG_FETCH       (0)
+#define TAG_LOAD        (1)
+#define TAG_STORE       (2)
+#define TAG_BLOCK       (3)
+#define TAG_RAW         (7)
+
+_Static_assert((TRACE_CODEC_PAD & TAG_TYPE_MASK) == TRACE_CODEC_PAD &&
+               TRACE_CODEC_PAD > TAG_BLOCK && TRACE_CODEC_PAD < TAG_RAW,
+               "TRACE_CODEC_PAD must be a free event type");
+
+#define TAG_PC_SEQ      (1 << 3)    // PC implied by the previous event
+#define TAG_STATIC_HIT  (1 << 4)    // Static fields from the table
+#define TAG_ADDR_HIT    (1 << 5)    // Data address from the stride predictor
+#define TAG_PA_HIT      (1 << 6)    // Data PA - VA same as last time
+#define TAG_FLAGS       (1 << 7)    // Followed by a flag byte
+#define TAG_TARGET      TAG_FLAGS   // Fetch followed by its branch target
+
+#define FLAG_IO         (1 << 0)
+#define FLAG_ATOMIC     (1 << 1)
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+static inline uint8_t*
+put_varint(uint8_t* p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+static inline uint8_t const *
+get_varint(uint8_t const * p, uint64_t* v)
+{
+    uint64_t r = 0;
+    unsigned int shift = 0;
+
+    while (*p & 0x80)
+    {
+        r |= (uint64_t)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *v = r | ((uint64_t)*p++ << shift);
+    return p;
+}
+
+static inline uint8_t*
+put_svarint(uint8_t* p, int64_t v)
+{
+    return put_varint(p, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+static inline uint8_t const *
+get_svarint(uint8_t const * p, int64_t* v)
+{
+    uint64_t u;
+    p = get_varint(p, &u);
+    *v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+    return p;
+}
+
+static inline uint8_t*
+put_u32(uint8_t* p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+static inline uint8_t const *
+get_u32(uint8_t const * p, uint32_t* v)
+{
+    memcpy(v, p, sizeof(*v));
+    return p + sizeof(*v);
+}
+
+/**
+ * Padding that brings `p' to a 4-byte boundary, for the block opcodes.
+ */
+static inline size_t
+align_pad(void const * p)
+{
+    return -(uintptr_t)p & 3;
+}
+
+static inline trace_codec_entry_t*
+entry_of(trace_codec_t* codec, logical_address_t pc)
+{
+    uint64_t h = (pc >> 2) * 0x9E3779B97F4A7C15ull;
+    return &codec->table[h >> (64 - TRACE_CODEC_TABLE_BITS)];
+}
+
+/**
+ * Entry of `pc', claimed for it when it belonged to another PC or to a
+ * previous stream.
+ */
+static inline trace_codec_entry_t*
+claim_entry(trace_codec_t* codec, logical_address_t pc)
+{
+    trace_codec_entry_t* e = entry_of(codec, pc);
+
+    if (e->gen != codec->gen || e->pc != pc)
+    {
+        memset(e, 0, sizeof(*e));
+        e->gen = codec->gen;
+        e->pc  = pc;
+    }
+
+    return e;
+}
+
+static inline bool
+entry_valid(trace_codec_t const * codec, trace_codec_entry_t const * e, logical_address_t pc)
+{
+    return e->gen == codec->gen && e->pc == pc;
+}
+
+/**
+ * Whether the event only has the fields the trace plugin fills for its
+ * type, the others being 0. Anything else is stored raw.
+ */
+static bool
+is_compact(memory_transaction_t const * tr)
+{
+    generic_transaction_t const * s = &tr->s;
+
+    if (s->annul || s->inquiry || s->may_stall ||
+        s->speculative || s->ignore || s->inverse_endian ||
+        tr->cache || tr->cache_op || tr->line || tr->data_is_set_and_way ||
+        s->exception > UINT8_MAX || s->branch_type > UINT8_MAX)
+        return false;
+
+    switch (s->type)
+    {
+    case QEMU_Trans_Instr_Fetch:
+        return s->logical_address == s->pc && s->size <= UINT8_MAX &&
+               !s->atomic && !tr->io &&
+               !tr->addr_range.start_paddr && !tr->addr_range.end_paddr;
+
+    case QEMU_Trans_Load:
+    case QEMU_Trans_Store:
+        return s->size <= UINT8_MAX && s->branch_type == QEMU_Non_Branch && !s->target_address &&
+               !tr->addr_range.start_paddr && !tr->addr_range.end_paddr;
+
+    case QEMU_Trans_Instr_Block:
+        return s->logical_address == s->pc && !s->opcode && !s->atomic && !tr->io && !s->target_address &&
+               tr->block.n_insns <= TRACE_CODEC_MAX_INSNS &&
+               s->size == tr->block.n_insns * sizeof(uint32_t);
+
+    default:
+        return false;
+    }
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_codec_reset(trace_codec_t* codec)
+{
+    // Entries of older streams are told apart by their generation
+    if (++codec->gen == 0)
+    {
+        memset(codec->table, 0, sizeof(codec->table));
+        codec->gen = 1;
+    }
+
+    codec->cur_pc  = 0;
+    codec->next_pc = 0;
+}
+
+size_t
+trace_codec_encode(trace_codec_t* codec, memory_transaction_t const * tr, uint8_t* out)
+{
+    generic_transaction_t const * s = &tr->s;
+    uint8_t* p = out + 1;
+    uint8_t tag;
+
+    if (!is_compact(tr))
+    {
+        *out = TAG_RAW;
+        memcpy(p, tr, sizeof(*tr));
+        p += sizeof(*tr);
+
+        if (s->type == QEMU_Trans_Instr_Block)
+        {
+            assert(tr->block.n_insns <= TRACE_CODEC_MAX_INSNS);
+            p += align_pad(p);
+            memcpy(p, tr->block.opcodes, tr->block.n_insns * sizeof(uint32_t));
+            p += tr->block.n_insns * sizeof(uint32_t);
+        }
+
+        return p - out;
+    }
+
+    bool const is_data = (s->type == QEMU_Trans_Load || s->type == QEMU_Trans_Store);
+
+    // ─── PC ──────────────────────────────────────────────────────────────
+
+    logical_address_t const ref = is_data ? codec->cur_pc : codec->next_pc;
+
+    tag = (s->type == QEMU_Trans_Instr_Fetch) ? TAG_FETCH :
+          (s->type == QEMU_Trans_Load)        ? TAG_LOAD  :
+          (s->type == QEMU_Trans_Store)       ? TAG_STORE : TAG_BLOCK;
+
+    if (s->pc == ref)
+        tag |= TAG_PC_SEQ;
+    else
+        p = put_svarint(p, s->pc - ref);
+
+    trace_codec_entry_t* e = entry_of(codec, s->pc);
+    bool const valid = entry_valid(codec, e, s->pc);
+
+    switch (tag & TAG_TYPE_MASK)
+    {
+    case TAG_FETCH:
+    {
+        int64_t const pa_off = s->physical_address - s->pc;
+
+        if (valid && e->opcode == s->opcode && e->insn_id == tr->insn_id &&
+            e->exception == s->exception && e->branch_type == s->branch_type &&
+            e->fetch_size == s->size && e->pc_pa_off == pa_off)
+            tag |= TAG_STATIC_HIT;
+        else
+        {
+            p = put_u32(p, s->opcode);
+            p = put_varint(p, tr->insn_id);
+            p = put_varint(p, s->exception);
+            p = put_varint(p, s->branch_type);
+            p = put_varint(p, s->size);
+            p = put_svarint(p, pa_off);
+
+            e = claim_entry(codec, s->pc);
+            e->opcode      = s->opcode;
+            e->insn_id     = tr->insn_id;
+            e->exception   = s->exception;
+            e->branch_type = s->branch_type;
+            e->fetch_size  = s->size;
+            e->pc_pa_off   = pa_off;
+        }
+
+        codec->next_pc = s->pc + s->size;
+
+        // Taken or not, the next fetch is then implied
+        if (s->target_address)
+        {
+            tag |= TAG_TARGET;
+            p = put_svarint(p, s->target_address - codec->next_pc);
+            codec->next_pc = s->target_address;
+        }
+        break;
+    }
+
+    case TAG_LOAD:
+    case TAG_STORE:
+    {
+        if (valid && e->opcode == s->opcode && e->insn_id == tr->insn_id &&
+            e->exception == s->exception && e->data_size == s->size)
+            tag |= TAG_STATIC_HIT;
+        else
+        {
+            p = put_u32(p, s->opcode);
+            p = put_varint(p, tr->insn_id);
+            p = put_varint(p, s->exception);
+            p = put_varint(p, s->size);
+
+            e = claim_entry(codec, s->pc);
+            e->opcode    = s->opcode;
+            e->insn_id   = tr->insn_id;
+            e->exception = s->exception;
+            e->data_size = s->size;
+        }
+
+        logical_address_t const va = s->logical_address;
+        int64_t const pa_off = s->physical_address - va;
+
+        if (va == e->last_va + e->stride)
+            tag |= TAG_ADDR_HIT;
+        else
+            p = put_svarint(p, va - e->last_va);
+
+        if (pa_off == e->data_pa_off)
+            tag |= TAG_PA_HIT;
+        else
+            p = put_svarint(p, pa_off - e->data_pa_off);
+
+        e->stride      = va - e->last_va;
+        e->last_va     = va;
+        e->data_pa_off = pa_off;
+
+        if (tr->io || s->atomic)
+        {
+            tag |= TAG_FLAGS;
+            *p++ = (tr->io ? FLAG_IO : 0) | (s->atomic ? FLAG_ATOMIC : 0);
+        }
+        break;
+    }
+
+    case TAG_BLOCK:
+    {
+        int64_t const pa_off = s->physical_address - s->pc;
+
+        if (valid && e->insn_id == tr->insn_id && e->exception == s->exception &&
+            e->branch_type == s->branch_type && e->pc_pa_off == pa_off)
+            tag |= TAG_STATIC_HIT;
+        else
+        {
+            p = put_varint(p, tr->insn_id);
+            p = put_varint(p, s->exception);
+            p = put_varint(p, s->branch_type);
+            p = put_svarint(p, pa_off);
+
+            e = claim_entry(codec, s->pc);
+            e->insn_id     = tr->insn_id;
+            e->exception   = s->exception;
+            e->branch_type = s->branch_type;
+            e->pc_pa_off   = pa_off;
+        }
+
+        // Opcodes are not predicted, a block is mostly seen once per flush
+        p = put_varint(p, tr->block.n_insns);
+        p += align_pad(p);
+        memcpy(p, tr->block.opcodes, tr->block.n_insns * sizeof(uint32_t));
+        p += tr->block.n_insns * sizeof(uint32_t);
+
+        codec->next_pc = s->pc + s->size;
+        break;
+    }
+    }
+
+    codec->cur_pc = s->pc;
+
+    *out = tag;
+    return p - out;
+}
+
+size_t
+trace_codec_decode(trace_codec_t* codec, uint8_t const * in, memory_transaction_t* tr)
+{
+    generic_transaction_t* s = &tr->s;
+    uint8_t const * p = in + 1;
+    uint8_t const tag = *in;
+
+    if ((tag & TAG_TYPE_MASK) == TAG_RAW)
+    {
+        memcpy(tr, p, sizeof(*tr));
+        p += sizeof(*tr);
+
+        if (s->type == QEMU_Trans_Instr_Block)
+        {
+            p += align_pad(p);
+            tr->block.opcodes = (uint32_t const *) p;
+            p += tr->block.n_insns * sizeof(uint32_t);
+        }
+
+        return p - in;
+    }
+
+    memset(tr, 0, sizeof(*tr));
+
+    bool const is_data = ((tag & TAG_TYPE_MASK) == TAG_LOAD || (tag & TAG_TYPE_MASK) == TAG_STORE);
+
+    // ─── PC ──────────────────────────────────────────────────────────────
+
+    s->pc = is_data ? codec->cur_pc : codec->next_pc;
+
+    if (!(tag & TAG_PC_SEQ))
+    {
+        int64_t delta;
+        p = get_svarint(p, &delta);
+        s->pc += delta;
+    }
+
+    trace_codec_entry_t* e = entry_of(codec, s->pc);
+    uint64_t v;
+
+    switch (tag & TAG_TYPE_MASK)
+    {
+    case TAG_FETCH:
+    {
+        s->type = QEMU_Trans_Instr_Fetch;
+
+        if (!(tag & TAG_STATIC_HIT))
+        {
+            e = claim_entry(codec, s->pc);
+            p = get_u32(p, &e->opcode);
+            p = get_varint(p, &v); e->insn_id     = v;
+            p = get_varint(p, &v); e->exception   = v;
+            p = get_varint(p, &v); e->branch_type = v;
+            p = get_varint(p, &v); e->fetch_size  = v;
+            p = get_svarint(p, &e->pc_pa_off);
+        }
+
+        s->opcode           = e->opcode;
+        s->exception        = e->exception;
+        s->branch_type      = e->branch_type;
+        tr->insn_id         = e->insn_id;
+        s->size             = e->fetch_size;
+        s->logical_address  = s->pc;
+        s->physical_address = s->pc + e->pc_pa_off;
+
+        codec->next_pc = s->pc + s->size;
+
+        if (tag & TAG_TARGET)
+        {
+            int64_t delta;
+            p = get_svarint(p, &delta);
+            s->target_address = codec->next_pc + delta;
+            codec->next_pc = s->target_address;
+        }
+        break;
+    }
+
+    case TAG_LOAD:
+    case TAG_STORE:
+    {
+        s->type = ((tag & TAG_TYPE_MASK) == TAG_LOAD) ? QEMU_Trans_Load : QEMU_Trans_Store;
+
+        if (!(tag & TAG_STATIC_HIT))
+        {
+            e = claim_entry(codec, s->pc);
+            p = get_u32(p, &e->opcode);
+            p = get_varint(p, &v); e->insn_id   = v;
+            p = get_varint(p, &v); e->exception = v;
+            p = get_varint(p, &v); e->data_size = v;
+        }
+
+        logical_address_t va = e->last_va + e->stride;
+        if (!(tag & TAG_ADDR_HIT))
+        {
+            int64_t delta;
+            p = get_svarint(p, &delta);
+            va = e->last_va + delta;
+        }
+
+        if (!(tag & TAG_PA_HIT))
+        {
+            int64_t delta;
+            p = get_svarint(p, &delta);
+            e->data_pa_off += delta;
+        }
+
+        e->stride   = va - e->last_va;
+        e->last_va  = va;
+
+        s->opcode           = e->opcode;
+        s->exception        = e->exception;
+        s->size             = e->data_size;
+        tr->insn_id         = e->insn_id;
+        s->logical_address  = va;
+        s->physical_address = va + e->data_pa_off;
+
+        if (tag & TAG_FLAGS)
+        {
+            uint8_t const flags = *p++;
+            tr->io    = !!(flags & FLAG_IO);
+            s->atomic = !!(flags & FLAG_ATOMIC);
+        }
+        break;
+    }
+
+    case TAG_BLOCK:
+    {
+        s->type = QEMU_Trans_Instr_Block;
+
+        if (!(tag & TAG_STATIC_HIT))
+        {
+            e = claim_entry(codec, s->pc);
+            p = get_varint(p, &v); e->insn_id     = v;
+            p = get_varint(p, &v); e->exception   = v;
+            p = get_varint(p, &v); e->branch_type = v;
+            p = get_svarint(p, &e->pc_pa_off);
+        }
+
+        p = get_varint(p, &v);
+        p += align_pad(p);
+
+        tr->block.n_insns = v;
+        tr->block.opcodes = (uint32_t const *) p;
+        p += tr->block.n_insns * sizeof(uint32_t);
+
+        s->exception        = e->exception;
+        s->branch_type      = e->branch_type;
+        s->size             = tr->block.n_insns * sizeof(uint32_t);
+        tr->insn_id         = e->insn_id;
+        s->logical_address  = s->pc;
+        s->physical_address = s->pc + e->pc_pa_off;
+
+        codec->next_pc = s->pc + s->size;
+        break;
+    }
+    }
+
+    codec->cur_pc = s->pc;
+
+    return p - in;
+}
@@ -0,0 +1,106 @@
+/*
+ * Compact encoding of the trace events, for the per-vCPU rings and the
+ * trace files (-libqflex trace-encoding=compact).
+ *
+ * Only depends on the legacy API, so that tools outside of QEMU can decode
+ * the traces.
+ *
+ * An event starts with a tag byte, the event type and which fields are
+ * predicted, then the fields that were not, as LEB128 varints (zigzag for
+ * signed deltas):
+ *
+ *  - Static fields (opcode, dictionary ID, EL, sizes, branch type, PA of
+ *    the PC) live in a table of static instructions indexed by PC, shared
+ *    by the encoder and the decoder. They are only sent when the entry of
+ *    the PC misses.
+ *  - The PC is implied when it follows the previous instruction, otherwise
+ *    sent as a delta. A branch with a known target (trace-branch=on) sends
+ *    it as a delta to its fall-through, and implies the PC that follows.
+ *  - Data addresses are predicted per PC from the last address and stride,
+ *    and sent as a delta to the last address on a misprediction. Physical
+ *    addresses are sent as their distance to the virtual one, which rarely
+ *    changes for a given PC.
+ *
+ * Events the encoding cannot represent are escaped and stored raw.
+ * Encoder and decoder state must evolve in lockstep: a stream starts from
+ * trace_codec_reset() on both sides and is decoded in order.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQFLEX_TRACE_CODEC_H
+#define LIBQFLEX_TRACE_CODEC_H
+
+#include "../../libqflex-legacy-api.h"
+
+#define TRACE_CODEC_TABLE_BITS  (12)
+#define TRACE_CODEC_TABLE_SIZE  (1 << TRACE_CODEC_TABLE_BITS)
+
+// Largest block of a QEMU_Trans_Instr_Block event (TCG_MAX_INSNS)
+#define TRACE_CODEC_MAX_INSNS   (512)
+
+// Never starts an encoded event, free for the framing of the streams
+#define TRACE_CODEC_PAD         (0x06)
+
+// Bound of the encoding of one event, escaped block included
+#define TRACE_CODEC_MAX_EVENT   (1 + 3 + sizeof(memory_transaction_t) + \
+                                 4 * TRACE_CODEC_MAX_INSNS + 4 * 10)
+
+typedef struct
+{
+    uint32_t            gen;        // valid when equal to the codec one
+    uint32_t            opcode;
+    uint32_t            insn_id;
+    logical_address_t   pc;
+    // pc_pa - pc of fetches, pa - va of the last data access
+    int64_t             pc_pa_off;
+    int64_t             data_pa_off;
+
+    uint8_t             exception;
+    uint8_t             branch_type;
+    uint8_t             fetch_size;
+    uint8_t             data_size;
+
+    // Stride predictor of the data accesses
+    logical_address_t   last_va;
+    int64_t             stride;
+
+} trace_codec_entry_t;
+
+typedef struct
+{
+    uint32_t            gen;
+    logical_address_t   cur_pc;
+    logical_address_t   next_pc;
+
+    trace_codec_entry_t table[TRACE_CODEC_TABLE_SIZE];
+
+} trace_codec_t;
+
+/**
+ * Start a new stream, forgetting every prediction.
+ */
+void
+trace_codec_reset(trace_codec_t* codec);
+
+/**
+ * Encode an event at `out', which must have TRACE_CODEC_MAX_EVENT bytes.
+ * Block opcodes are 4-byte aligned in memory, so `out' and the buffer
+ * given to the decoder must have the same alignment modulo 4.
+ *
+ * @return The number of bytes written.
+ */
+size_t
+trace_codec_encode(trace_codec_t* codec, memory_transaction_t const * tr, uint8_t* out);
+
+/**
+ * Decode the event at `in'. The `block.opcodes' of a block event point
+ * into `in'.
+ *
+ * @return The number of bytes read.
+ */
+size_t
+trace_codec_decode(trace_codec_t* codec, uint8_t const * in, memory_transaction_t* tr);
+
+#endif
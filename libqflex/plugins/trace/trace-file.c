@@ -0,0 +1,323 @@
+/*
+ * Trace file writer of the trace plugin, see trace-format.h.
+ *
+ * Every vCPU fills its own chunk buffer and hands it to a writer thread
+ * once full, which compresses it, appends it to the file and to the index,
+ * and gives the buffer back. A vCPU only waits when the writer is more than
+ * TRACE_FILE_SPARE_CHUNKS chunks per vCPU behind, which bounds the memory
+ * held by pending chunks.
+ *
+ * Chunks are stamped with the instruction counter of their vCPU when their
+ * first event is recorded, so that a trace can be sought by instruction
+ * whatever was filtered or sampled out.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
+
+#include <zlib.h>
+
+#include "middleware/libqflex/libqflex-legacy-api.h"
+#include "middleware/libqflex/libqflex-module.h"
+#include "trace.h"
+#include "trace-codec.h"
+#include "trace-format.h"
+
+#define TRACE_FILE_CHUNK_DEFAULT    (1 * MiB)
+#define TRACE_FILE_CHUNK_MIN        (64 * KiB)
+// Full chunks that may wait for the writer, per vCPU
+#define TRACE_FILE_SPARE_CHUNKS     (2)
+
+typedef struct
+{
+    uint32_t    vcpu;
+    uint32_t    n_events;
+    size_t      used;
+    uint64_t    first_insn;
+    uint64_t    n_insns;
+
+    uint8_t     raw[];
+} trace_file_chunk_t;
+
+typedef struct
+{
+    trace_file_chunk_t* chunk;
+
+    // Reset on every chunk, NULL for the raw encoding
+    trace_codec_t* codec;
+
+} __attribute__((aligned(64))) trace_file_vcpu_t;
+
+static int fd = -1;
+static size_t chunk_bytes = 0;
+static bool compact = false;
+
+static trace_file_vcpu_t* vcpus = NULL;
+static size_t n_vcpus = 0;
+
+// Full chunks to the writer, empty ones back to the vCPUs
+static GAsyncQueue* full = NULL;
+static GAsyncQueue* empty = NULL;
+static GThread* writer = NULL;
+// Pushed to `full' to stop the writer
+static trace_file_chunk_t stop;
+
+// Writer thread only
+static uint64_t file_offset = 0;
+static GArray* chunk_index = NULL;
+static uint64_t raw_total = 0;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+static void
+write_at(void const * buf, size_t size, uint64_t offset)
+{
+    if (pwrite(fd, buf, size, offset) != (ssize_t) size)
+    {
+        error_report("ERROR: trace-file write failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Compress and append chunks until told to stop, so that vCPUs never wait
+ * on zlib or on the disk unless it falls behind by more than the spare
+ * chunks.
+ */
+static gpointer
+trace_file_writer_loop(gpointer arg)
+{
+    uLong const stored_bound = compressBound(chunk_bytes);
+    g_autofree uint8_t* stored = g_malloc(stored_bound);
+    trace_file_chunk_t* c;
+
+    while ((c = g_async_queue_pop(full)) != &stop)
+    {
+        qflex_trace_chunk_t chunk = {
+            .magic      = QFLEX_TRACE_CHUNK_MAGIC,
+            .vcpu       = c->vcpu,
+            .codec      = QFLEX_TRACE_CODEC_ZLIB,
+            .n_events   = c->n_events,
+            .first_insn = c->first_insn,
+            .n_insns    = c->n_insns,
+            .raw_bytes  = c->used,
+        };
+
+        uLongf stored_size = stored_bound;
+        if (compress2(stored, &stored_size, c->raw, c->used, Z_BEST_SPEED) != Z_OK)
+        {
+            error_report("ERROR: trace-file compression failed");
+            exit(EXIT_FAILURE);
+        }
+        chunk.stored_bytes = stored_size;
+
+        qflex_trace_index_t entry = {
+            .offset     = file_offset,
+            .vcpu       = chunk.vcpu,
+            .n_events   = chunk.n_events,
+            .first_insn = chunk.first_insn,
+            .n_insns    = chunk.n_insns,
+        };
+        g_array_append_val(chunk_index, entry);
+
+        write_at(&chunk, sizeof(chunk), file_offset);
+        write_at(stored, stored_size, file_offset + sizeof(chunk));
+
+        file_offset += sizeof(chunk) + stored_size;
+        raw_total += c->used;
+
+        g_async_queue_push(empty, c);
+    }
+
+    return NULL;
+}
+
+/**
+ * Hand the pending chunk of a vCPU to the writer and take an empty one,
+ * waiting for it when the writer is behind.
+ */
+static void
+flush_chunk(size_t vcpu_index)
+{
+    trace_file_vcpu_t* v = &vcpus[vcpu_index];
+    trace_file_chunk_t* c = v->chunk;
+
+    if (c->n_events == 0)
+        return;
+
+    // Up to where the next chunk starts
+    c->n_insns = trace_count_get_insns(vcpu_index) - c->first_insn;
+    g_async_queue_push(full, c);
+
+    v->chunk = g_async_queue_pop(empty);
+    v->chunk->n_events = 0;
+    v->chunk->used     = 0;
+
+    if (v->codec)
+        trace_codec_reset(v->codec);
+}
+
+/**
+ * Room for `size' bytes in the chunk of a vCPU, stamping the first event
+ * of a chunk with the instruction count of the vCPU.
+ */
+static inline trace_file_chunk_t*
+chunk_reserve(size_t vcpu_index, size_t size)
+{
+    trace_file_vcpu_t* v = &vcpus[vcpu_index];
+
+    if (v->chunk->used + size > chunk_bytes)
+        flush_chunk(vcpu_index);
+
+    trace_file_chunk_t* c = v->chunk;
+
+    if (c->n_events == 0)
+    {
+        c->vcpu       = vcpu_index;
+        c->first_insn = trace_count_get_insns(vcpu_index);
+    }
+
+    c->n_events++;
+    return c;
+}
+
+static void
+write_header(uint64_t n_chunks, uint64_t index_offset)
+{
+    qflex_trace_header_t header = {
+        .format_version = QFLEX_TRACE_FORMAT_VERSION,
+        .schema_version = LIBQFLEX_API_VERSION,
+        .record_size    = sizeof(memory_transaction_t),
+        .n_vcpus        = n_vcpus,
+        .chunk_bytes    = chunk_bytes,
+        .codec          = QFLEX_TRACE_CODEC_ZLIB,
+        .encoding       = compact ? QFLEX_TRACE_ENCODING_COMPACT : QFLEX_TRACE_ENCODING_RAW,
+        .n_chunks       = n_chunks,
+        .index_offset   = index_offset,
+    };
+    memcpy(header.magic, QFLEX_TRACE_MAGIC, sizeof(header.magic));
+
+    write_at(&header, sizeof(header), 0);
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trace_file_init(char const * path, size_t nb_vcpus, size_t chunk_size)
+{
+    fd = qemu_create(path, O_WRONLY | O_TRUNC, 0644, NULL);
+    if (fd < 0)
+    {
+        error_report("ERROR: cannot create trace-file %s: %s", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    n_vcpus = nb_vcpus;
+    // A block event with its opcodes must always fit in a chunk
+    chunk_bytes = chunk_size ? MAX(chunk_size, TRACE_FILE_CHUNK_MIN) : TRACE_FILE_CHUNK_DEFAULT;
+
+    compact = (qemu_libqflex_state.trace_encoding == TRACE_ENCODING_COMPACT);
+
+    full  = g_async_queue_new();
+    empty = g_async_queue_new();
+
+    for (size_t i = 0; i < n_vcpus * TRACE_FILE_SPARE_CHUNKS; i++)
+        g_async_queue_push(empty, g_malloc0(sizeof(trace_file_chunk_t) + chunk_bytes));
+
+    vcpus = g_new0(trace_file_vcpu_t, n_vcpus);
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        vcpus[i].chunk = g_malloc0(sizeof(trace_file_chunk_t) + chunk_bytes);
+
+        if (compact)
+        {
+            vcpus[i].codec = g_new0(trace_codec_t, 1);
+            trace_codec_reset(vcpus[i].codec);
+        }
+    }
+
+    chunk_index = g_array_new(false, false, sizeof(qflex_trace_index_t));
+
+    // Rewritten with the index location when the trace is closed
+    write_header(0, 0);
+    file_offset = sizeof(qflex_trace_header_t);
+
+    writer = g_thread_new("qflex-trace-file", trace_file_writer_loop, NULL);
+}
+
+void
+trace_file_write(unsigned int vcpu_index, memory_transaction_t const * tr)
+{
+    trace_file_vcpu_t* v = &vcpus[vcpu_index];
+
+    if (compact)
+    {
+        trace_file_chunk_t* c = chunk_reserve(vcpu_index, TRACE_CODEC_MAX_EVENT);
+        c->used += trace_codec_encode(v->codec, tr, &c->raw[c->used]);
+        return;
+    }
+
+    size_t const size = qflex_trace_event_size(tr);
+    trace_file_chunk_t* c = chunk_reserve(vcpu_index, size);
+
+    memory_transaction_t* rec = (memory_transaction_t*) &c->raw[c->used];
+    *rec = *tr;
+
+    if (tr->s.type == QEMU_Trans_Instr_Block)
+    {
+        size_t const opcodes = tr->block.n_insns * sizeof(uint32_t);
+
+        rec->block.opcodes = NULL;
+        memcpy(rec + 1, tr->block.opcodes, opcodes);
+        memset((uint8_t*)(rec + 1) + opcodes, 0, size - sizeof(*rec) - opcodes);
+    }
+
+    c->used += size;
+}
+
+void
+trace_file_close(void)
+{
+    if (fd < 0)
+        return;
+
+    for (size_t i = 0; i < n_vcpus; i++)
+        flush_chunk(i);
+
+    g_async_queue_push(full, &stop);
+    g_thread_join(writer);
+    writer = NULL;
+
+    write_at(chunk_index->data, chunk_index->len * sizeof(qflex_trace_index_t), file_offset);
+    write_header(chunk_index->len, file_offset);
+
+    g_autofree char* report = g_strdup_printf(
+        "> TRACE_FILE: %u chunks, %" PRIu64 " MB raw, %" PRIu64 " MB stored\n",
+        chunk_index->len, raw_total / MiB, file_offset / MiB);
+    qemu_plugin_outs(report);
+
+    close(fd);
+    fd = -1;
+
+    for (size_t i = 0; i < n_vcpus; i++)
+    {
+        g_free(vcpus[i].chunk);
+        g_free(vcpus[i].codec);
+    }
+    g_free(vcpus);
+
+    trace_file_chunk_t* c;
+    while ((c = g_async_queue_try_pop(empty)) != NULL)
+        g_free(c);
+
+    g_async_queue_unref(full);
+    g_async_queue_unref(empty);
+    g_array_free(chunk_index, true);
+
+    vcpus = NULL;
+    chunk_index = NULL;
+}
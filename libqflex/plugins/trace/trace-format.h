@@ -0,0 +1,114 @@
+/*
+ * On-disk format of the trace files written with -libqflex trace-file.
+ *
+ * Only depends on the legacy API, so that tools outside of QEMU can read
+ * the traces.
+ *
+ *   qflex_trace_header_t
+ *   { qflex_trace_chunk_t, payload }*
+ *   qflex_trace_index_t[n_chunks]
+ *
+ * A chunk holds consecutive events of a single vCPU, compressed as a whole.
+ * With QFLEX_TRACE_ENCODING_RAW an event is a memory_transaction_t;
+ * QEMU_Trans_Instr_Block events are followed by their `n_insns' opcodes,
+ * padded to 8 bytes, and their `block.opcodes' pointer is meaningless on
+ * disk. With QFLEX_TRACE_ENCODING_COMPACT events are encoded as in
+ * trace-codec.h, the codec being reset at the start of every chunk.
+ *
+ * The static instruction dictionary (-libqflex insn-dict) goes to a side
+ * file, a qflex_dict_header_t followed by static_insn_t records, in the
+ * order the vCPUs translated them rather than in ID order.
+ *
+ * The index is written when the trace is closed. A trace whose header has
+ * no index (QEMU killed) can still be read by walking the chunk headers.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#ifndef LIBQFLEX_TRACE_FORMAT_H
+#define LIBQFLEX_TRACE_FORMAT_H
+
+#include "../../libqflex-legacy-api.h"
+
+#define QFLEX_TRACE_MAGIC           "QFLXTRCE"
+#define QFLEX_TRACE_CHUNK_MAGIC     (0x4b4e4843u)   // "CHNK"
+
+// Layout of this file, independently of the event schema
+// 2: adds `encoding'
+#define QFLEX_TRACE_FORMAT_VERSION  (2)
+
+typedef enum {
+  QFLEX_TRACE_CODEC_NONE = 0,
+  QFLEX_TRACE_CODEC_ZLIB = 1,
+} qflex_trace_codec_t;
+
+typedef enum {
+  QFLEX_TRACE_ENCODING_RAW     = 0,
+  QFLEX_TRACE_ENCODING_COMPACT = 1,
+} qflex_trace_encoding_t;
+
+typedef struct {
+  char      magic[8];
+  uint32_t  format_version;
+  // LIBQFLEX_API_VERSION and sizeof(memory_transaction_t) of the writer
+  uint32_t  schema_version;
+  uint32_t  record_size;
+  uint32_t  n_vcpus;
+  // Upper bound of the uncompressed payload of a chunk
+  uint32_t  chunk_bytes;
+  uint32_t  codec;
+  uint32_t  encoding;
+  uint32_t  reserved;
+  uint64_t  n_chunks;
+  // 0 until the trace is closed
+  uint64_t  index_offset;
+} qflex_trace_header_t;
+
+typedef struct {
+  uint32_t  magic;
+  uint32_t  vcpu;
+  uint32_t  codec;
+  uint32_t  n_events;
+  // Instructions executed by the vCPU before the first event of the chunk,
+  // and from there to the first event of its next chunk
+  uint64_t  first_insn;
+  uint64_t  n_insns;
+  uint64_t  raw_bytes;
+  uint64_t  stored_bytes;
+} qflex_trace_chunk_t;
+
+typedef struct {
+  // File offset of the qflex_trace_chunk_t
+  uint64_t  offset;
+  uint32_t  vcpu;
+  uint32_t  n_events;
+  uint64_t  first_insn;
+  uint64_t  n_insns;
+} qflex_trace_index_t;
+
+#define QFLEX_DICT_MAGIC            "QFLXDICT"
+#define QFLEX_DICT_FORMAT_VERSION   (1)
+
+typedef struct {
+  char      magic[8];
+  uint32_t  format_version;
+  // sizeof(static_insn_t) of the writer
+  uint32_t  record_size;
+} qflex_dict_header_t;
+
+/**
+ * Bytes taken by an event in a chunk payload.
+ */
+static inline size_t
+qflex_trace_event_size(memory_transaction_t const * tr)
+{
+  size_t size = sizeof(memory_transaction_t);
+
+  if (tr->s.type == QEMU_Trans_Instr_Block)
+    size += (tr->block.n_insns * sizeof(uint32_t) + 7) & ~(size_t)7;
+
+  return size;
+}
+
+#endif
@@ -8,12 +8,17 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/log.h"
 
 #include "qemu/plugin-memory.h"
 #include "qemu/qemu-plugin.h"
 #include "target/arm/cpu.h"
 
 #include "middleware/libqflex/libqflex-legacy-api.h"
+#include "middleware/libqflex/libqflex-module.h"
+#include "middleware/libqflex/libqflex.h"
+#include "middleware/libqflex/libqflex-prof.h"
 #include "trace.h"
 
 
@@ -21,21 +26,6 @@
 // it was compiled for
 QEMU_PLUGIN_EXPORT int qemu_plugin_version = QEMU_PLUGIN_VERSION;
 
-static GMutex lock;
-static GHashTable* tb_table;
-
-/**
- * Free a translation cache entry from the GHashMap
- * This is mainly called on plugin destruction
- */
-static void
-trans_free(gpointer data)
-{
-    trace_insn_t* trans = (trace_insn_t *) data;
-    // g_string_free(trans->disas_str, true);
-    g_free(trans);
-}
-
 /**
  * @brief Dispatches memory access.
  * @details Called on every translation of memory's accessing instruction.
@@ -53,17 +43,16 @@ dispatch_memory_access(unsigned int vcpu_index, qemu_plugin_meminfo_t info, uint
     trace_insn_t* insn = (trace_insn_t*) userdata;
 
     /**
-     * Checking if the decoder and QEMU agree on the type of memory access
-     * Usless possibly, only useful to retrieve info about atomic store or load
-     */
-    struct mem_access mem_info = {0};
-    g_assert(decode_armv8_mem_opcode(&mem_info, insn->opcode));
-    /**
-     * Store Exclusive is conditional, therefore we should make sure
-     * that memory was infact accessed
+     * Store Exclusive is conditional, therefore the direction is the one
+     * QEMU reports. An access the decoder does not know (MTE tags...), or
+     * whose direction it got wrong, is sent with QEMU's width as undecoded
+     * rather than dropped.
      */
-    mem_info.is_store &= qemu_plugin_mem_is_store(info);
-    g_assert(mem_info.is_store == qemu_plugin_mem_is_store(info));
+    bool const is_store = qemu_plugin_mem_is_store(info);
+    bool const decoded  = insn->has_mem_access && (insn->mem.is_store || !is_store);
+
+    if (!decoded && qemu_libqflex_state.stats)
+        trace_count_undecoded(vcpu_index);
 
     // ─────────────────────────────────────────────────────────────────────
 
@@ -75,18 +64,23 @@ dispatch_memory_access(unsigned int vcpu_index, qemu_plugin_meminfo_t info, uint
 
     tr.io = (hwaddr && qemu_plugin_hwaddr_is_io(hwaddr));
 
+    if (tr.io && qemu_libqflex_state.stats)
+        trace_count_io(vcpu_index);
+
     tr.s.pc                 = insn->target_pc_va;
     tr.s.opcode             = insn->opcode;
     tr.s.logical_address    = vaddr;
     tr.s.exception          = insn->exception_lvl;
     tr.s.physical_address   = hwaddr->phys_addr;
 
-    tr.s.size   = mem_info.size;
-    tr.s.atomic = mem_info.is_atomic;
-    tr.s.type   = mem_info.is_store ? QEMU_Trans_Store : QEMU_Trans_Load;
+    tr.s.size   = decoded ? insn->mem.size : qemu_plugin_mem_size_shift(info);
+    tr.s.atomic = decoded && insn->mem.is_atomic;
+    tr.s.type   = is_store ? QEMU_Trans_Store : QEMU_Trans_Load;
+
+    tr.insn_id  = insn->insn_id;
 
 
-    flexus_api.trace_mem(vcpu_index, &tr);
+    trace_sink_emit(vcpu_index, &tr);
 }
 
 /**
@@ -105,8 +99,6 @@ dispatch_instruction(unsigned int vcpu_index, void* userdata)
     trace_insn_t* insn = (trace_insn_t*) userdata;
     g_assert(insn->target_pc_va);
 
-    MemTxAttrs attrs;
-    branch_type_t br_type;
     memory_transaction_t tr = {0};
 
     tr.io = false;
@@ -114,14 +106,98 @@ dispatch_instruction(unsigned int vcpu_index, void* userdata)
     tr.s.opcode           = insn->opcode;
     tr.s.pc               = insn->target_pc_va;
     tr.s.logical_address  = insn->target_pc_va;
-    tr.s.physical_address = arm_cpu_get_phys_page_attrs_debug(current_cpu, insn->target_pc_va,  &attrs);
+    tr.s.physical_address = insn->target_pc_pa;
     tr.s.exception        = insn->exception_lvl;
 
     tr.s.size        = insn->byte_size;
-    tr.s.branch_type = decode_armv8_branch_opcode(&br_type, insn->opcode) ? br_type : QEMU_Non_Branch;
+    tr.s.branch_type = insn->branch_type;
     tr.s.type        = QEMU_Trans_Instr_Fetch;
 
-    flexus_api.trace_mem(vcpu_index, &tr);
+    tr.insn_id       = insn->insn_id;
+
+    // Sent once its target is known, from the next block
+    if (qemu_libqflex_state.trace_branch && insn->branch_type != QEMU_Non_Branch)
+    {
+        trace_branch_defer(vcpu_index, &tr, insn);
+        return;
+    }
+
+    trace_sink_emit(vcpu_index, &tr);
+}
+
+/**
+ * @brief Resolves the branch that led to a block.
+ * @details Only registered with -libqflex trace-branch=on, runs before any
+ *          instruction of the block.
+ *
+ * @param vcpu_index Index of the virtual CPU.
+ * @param userdata Virtual address of the block.
+ */
+static void
+dispatch_branch_resolve(unsigned int vcpu_index, void* userdata)
+{
+    trace_branch_resolve(vcpu_index, (logical_address_t) (uintptr_t) userdata);
+}
+
+/**
+ * @brief Dispatches block.
+ * @details Called on every execution of a translated block in
+ *          trace-mode=block, in place of one call per instruction.
+ *
+ * @param vcpu_index Index of the virtual CPU.
+ * @param userdata Static block record.
+ */
+static void
+dispatch_block(unsigned int vcpu_index, void* userdata)
+{
+    trace_block_t* block = (trace_block_t*) userdata;
+    memory_transaction_t tr = {0};
+
+    tr.io = false;
+
+    tr.s.pc               = block->pc_va;
+    tr.s.logical_address  = block->pc_va;
+    tr.s.physical_address = block->pc_pa;
+    tr.s.exception        = block->exception_lvl;
+
+    tr.s.size        = block->n_insns * sizeof(uint32_t);
+    tr.s.branch_type = block->branch_type;
+    tr.s.type        = QEMU_Trans_Instr_Block;
+
+    tr.block.opcodes = block->opcodes;
+    tr.block.n_insns = block->n_insns;
+    tr.insn_id       = block->insn_id;
+
+    trace_sink_emit(vcpu_index, &tr);
+}
+
+/**
+ * @brief Logs an executed instruction with its disassembly.
+ * @details Only registered with -libqflex trace-disas=on.
+ *
+ * @param vcpu_index Index of the virtual CPU.
+ * @param userdata Generic translation info.
+ */
+static void
+dispatch_disas(unsigned int vcpu_index, void* userdata)
+{
+    trace_insn_t const * insn = (trace_insn_t const *) userdata;
+
+    qemu_log("> [Libqflex] CPU%u 0x%016" PRIx64 " [%u] %08x %s\n",
+             vcpu_index, insn->target_pc_va, insn->insn_id, insn->opcode,
+             trace_disas(vcpu_index, insn));
+}
+
+char const *
+trace_disas(unsigned int vcpu_index, trace_insn_t const * insn)
+{
+    char const * text = trans_cache_get_disas(insn);
+
+    if (text)
+        return text;
+
+    g_autofree char* fresh = libqflex_disas(vcpu_index, insn->target_pc_va, insn->byte_size);
+    return trans_cache_set_disas(insn, fresh ? fresh : "??");
 }
 
 /**
@@ -136,6 +212,33 @@ dispatch_vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb* tb)
     trace_insn_t* transaction = NULL;
     size_t nb_instruction = qemu_plugin_tb_n_insns(tb);
 
+    // A block spans at most two pages, walk the page table once per page
+    MemTxAttrs attrs;
+    logical_address_t page_va = -1;
+    physical_address_t page_pa = -1;
+
+    trace_block_t* block = NULL;
+    bool block_selected = false;
+    bool const count_only = (qemu_libqflex_state.trace_mode == TRACE_MODE_COUNT);
+
+    // Outside of the sampled windows blocks only keep their counters
+    bool const traced = !count_only && trace_sample_register(tb);
+    bool const per_block = traced && (qemu_libqflex_state.trace_mode == TRACE_MODE_BLOCK);
+
+    // Also in filtered out code, so that the merge does not wait for events
+    if (!count_only)
+        trace_order_register(tb);
+
+    // Vectors cover the whole run, skipped phases included
+    trace_bbv_register(tb);
+
+    trace_count_register_tb(tb, arm_current_el(&ARM_CPU(current_cpu)->env), qemu_libqflex_state.stats);
+
+    if (per_block)
+        block = trans_cache_alloc(
+            (uint64_t) qemu_plugin_insn_haddr(qemu_plugin_tb_get_insn(tb, 0)),
+            sizeof(trace_block_t) + nb_instruction * sizeof(uint32_t));
+
     // For each instruction in the translation block (TB)
     for (size_t i = 0; i < nb_instruction; i++)
     {
@@ -143,62 +246,162 @@ dispatch_vcpu_tb_trans(qemu_plugin_id_t id, struct qemu_plugin_tb* tb)
 
         physical_address_t host_pc_pa = (uint64_t) qemu_plugin_insn_haddr(insn);
 
-        g_mutex_lock(&lock);
-        transaction = g_hash_table_lookup(tb_table, GSIZE_TO_POINTER(host_pc_pa));
-        g_mutex_unlock(&lock);
+        trace_insn_t key = {
+            .target_pc_va   = qemu_plugin_insn_vaddr(insn),
+            .opcode         = * (uint32_t*)qemu_plugin_insn_haddr(insn), //? From the official plugins
+            .exception_lvl  = arm_current_el(&ARM_CPU(current_cpu)->env),
+        };
+
+        transaction = trans_cache_lookup(host_pc_pa, &key);
 
         if (transaction == NULL)
         {
-            transaction                         = g_new0(trace_insn_t, 1);
+            if ((key.target_pc_va & TARGET_PAGE_MASK) != page_va)
+            {
+                page_va = key.target_pc_va & TARGET_PAGE_MASK;
+                page_pa = arm_cpu_get_phys_page_attrs_debug(current_cpu, page_va, &attrs);
+            }
 
-            transaction->target_pc_va           = qemu_plugin_insn_vaddr(insn);
-            transaction->opcode                 = * (uint32_t*)qemu_plugin_insn_haddr(insn); //? From the official plugins
-            transaction->byte_size              = qemu_plugin_insn_size(insn);
-            transaction->disas_str              = qemu_plugin_insn_disas(insn);
-            transaction->exception_lvl          = arm_current_el(&ARM_CPU(current_cpu)->env);
+            key.target_pc_pa = page_pa | (key.target_pc_va & ~TARGET_PAGE_MASK);
+            key.byte_size = qemu_plugin_insn_size(insn);
 
-            g_mutex_lock(&lock);
-            g_hash_table_insert(tb_table, GSIZE_TO_POINTER(host_pc_pa), transaction);
-            g_mutex_unlock(&lock);
+            // The decoding only depends on the opcode, do it once here
+            // rather than on every execution
+            branch_type_t br_type;
+            key.has_mem_access = decode_armv8_mem_opcode(&key.mem, key.opcode);
+            key.branch_type = decode_armv8_branch_opcode(&br_type, key.opcode) ? br_type : QEMU_Non_Branch;
+
+            if (!key.has_mem_access && key.branch_type != QEMU_Non_Branch &&
+                !decode_armv8_branch_offset(&key.branch_offset, key.opcode))
+                key.branch_offset = TRACE_BRANCH_INDIRECT;
+
+            key.insn_id = trace_dict_id(&key);
+
+            transaction = trans_cache_insert(host_pc_pa, &key);
         }
 
-        qemu_plugin_register_vcpu_mem_cb(
-            insn,
-            dispatch_memory_access,
-            QEMU_PLUGIN_CB_NO_REGS,
-            QEMU_PLUGIN_MEM_RW,
-            (void*)transaction);
-
-        qemu_plugin_register_vcpu_insn_exec_cb(
-            insn,
-            dispatch_instruction,
-            QEMU_PLUGIN_CB_NO_REGS ,
-            (void*)transaction);
+        trace_count_register(insn, transaction, qemu_libqflex_state.stats);
+
+        if (!traced)
+            continue;
+
+        // Filtered out instructions get no callback at all
+        unsigned int const selected = trace_filter(transaction);
+
+        if (selected & TRACE_FILTER_MEM)
+            qemu_plugin_register_vcpu_mem_cb(
+                insn,
+                dispatch_memory_access,
+                QEMU_PLUGIN_CB_NO_REGS,
+                QEMU_PLUGIN_MEM_RW,
+                (void*)transaction);
+
+        if (per_block)
+        {
+            if (i == 0)
+            {
+                block_selected       = trace_filter_block(transaction);
+                block->pc_va         = transaction->target_pc_va;
+                block->pc_pa         = transaction->target_pc_pa;
+                block->n_insns       = nb_instruction;
+                block->exception_lvl = transaction->exception_lvl;
+                block->insn_id       = transaction->insn_id;
+            }
+
+            block->opcodes[i] = transaction->opcode;
+
+            // Only the last instruction of a block may branch
+            if (i == nb_instruction - 1)
+                block->branch_type = transaction->branch_type;
+            continue;
+        }
+
+        if (qemu_libqflex_state.trace_disas && selected)
+            qemu_plugin_register_vcpu_insn_exec_cb(
+                insn,
+                dispatch_disas,
+                QEMU_PLUGIN_CB_NO_REGS,
+                (void*)transaction);
+
+        if (selected & TRACE_FILTER_FETCH)
+            qemu_plugin_register_vcpu_insn_exec_cb(
+                insn,
+                dispatch_instruction,
+                QEMU_PLUGIN_CB_NO_REGS ,
+                (void*)transaction);
     }
+
+    // Registered last but QEMU runs TB callbacks before the first instruction
+    if (traced && qemu_libqflex_state.trace_branch)
+        qemu_plugin_register_vcpu_tb_exec_cb(
+            tb,
+            dispatch_branch_resolve,
+            QEMU_PLUGIN_CB_NO_REGS,
+            (void*)(uintptr_t)qemu_plugin_tb_vaddr(tb));
+
+    if (per_block && block_selected)
+        qemu_plugin_register_vcpu_tb_exec_cb(
+            tb,
+            dispatch_block,
+            QEMU_PLUGIN_CB_NO_REGS,
+            (void*)block);
 }
 
 
+/**
+ * Called on TB flush, once every vCPU is out of the generated code.
+ * No translated block references the instruction records anymore.
+ */
+static void
+dispatch_tb_flush(qemu_plugin_id_t id)
+{
+    trace_sink_flush();
+    trans_cache_flush();
+}
+
 static void
 exit_plugin(qemu_plugin_id_t id, void* p)
 {
+    // Flexus must have seen every event before the cache goes away
+    trace_branch_exit();
+    trace_sink_exit();
+    trace_dict_exit();
+    trace_bbv_exit();
+
+    trace_count_report(qemu_libqflex_state.n_vcpus, qemu_libqflex_state.stats);
+    trace_sample_report();
+    libqflex_prof_report();
+
     // ─── Logging Hashmap Translation Cache Size ──────────────────────────
 
-    guint hashmap_size = g_hash_table_size(tb_table);
-    gfloat hashmap_M_space = hashmap_size * sizeof(trace_insn_t) / 1e6;
+    trans_cache_stats_t stats;
+    trans_cache_get_stats(&stats);
 
-    char* size_logger   = g_strdup_printf("> HASH_MAP_SIZE: %i\n", hashmap_size);
+    gfloat hashmap_M_space = stats.entries * sizeof(trace_insn_t) / 1e6;
+    gfloat arena_M_space = stats.arena_bytes / 1e6;
+    gfloat reclaimed_M_space = stats.reclaimed_bytes / 1e6;
+
+    char* size_logger   = g_strdup_printf("> HASH_MAP_SIZE: %" PRIu64 "\n", stats.entries);
     char* space_logger  = g_strdup_printf("> HASH_MAP_MBYTES: %f\n", hashmap_M_space);
+    char* arena_logger  = g_strdup_printf("> ARENA_MBYTES: %f (reclaimed: %f over %" PRIu64 " flushes, replaced: %" PRIu64 ")\n",
+                                          arena_M_space, reclaimed_M_space, stats.flushes, stats.replaced);
     char* struct_size   = g_strdup_printf("> TRANSLATION_BYTES: %li\n", sizeof(trace_insn_t));
+    char* lock_logger   = g_strdup_printf("> HASH_MAP_LOCKS: %" PRIu64 " (contended: %" PRIu64 ", worst shard: %" PRIu64 ")\n",
+                                          stats.acquisitions, stats.contended, stats.max_contended);
 
     qemu_plugin_outs(struct_size);
     qemu_plugin_outs(size_logger);
     qemu_plugin_outs(space_logger);
+    qemu_plugin_outs(arena_logger);
+    qemu_plugin_outs(lock_logger);
 
     g_free(struct_size);
     g_free(size_logger);
     g_free(space_logger);
+    g_free(arena_logger);
+    g_free(lock_logger);
 
-    g_hash_table_destroy(tb_table);
+    trans_cache_destroy();
     qemu_plugin_outs("==> TRACE END");
 }
 
@@ -213,14 +416,34 @@ libqflex_trace_init(void)
 
     qemu_plugin_id_t qflex_trace_id = qemu_plugin_register_builtin();
 
-    tb_table = g_hash_table_new_full(
-        NULL,
-        g_direct_equal,
-        NULL,
-        trans_free);
+    trace_sink_init(qemu_libqflex_state.trace_sinks);
+    trace_order_attach(qflex_trace_id);
+
+    trans_cache_init();
+    trace_count_init(qemu_libqflex_state.trace_mode == TRACE_MODE_COUNT);
+    trace_dict_init(qemu_libqflex_state.insn_dict);
+    trace_filter_init();
+
+    if (qemu_libqflex_state.trace_branch)
+        trace_branch_init(qemu_libqflex_state.n_vcpus);
+
+    if (qemu_libqflex_state.bbv_file)
+        trace_bbv_init(
+            qemu_libqflex_state.n_vcpus,
+            qemu_libqflex_state.bbv_file,
+            qemu_libqflex_state.bbv_interval);
+
+    if (qemu_libqflex_state.trace_mode != TRACE_MODE_COUNT)
+        trace_sample_init(
+            qemu_libqflex_state.n_vcpus,
+            qemu_libqflex_state.sample_skip,
+            qemu_libqflex_state.sample_warm,
+            qemu_libqflex_state.sample_detail);
 
     // Register translation callback
     qemu_plugin_register_vcpu_tb_trans_cb(qflex_trace_id, dispatch_vcpu_tb_trans);
+    // Register TB flush, to reclaim the translation records
+    qemu_plugin_register_flush_cb(qflex_trace_id, dispatch_tb_flush);
     // Register plugin's exit mechanism
     qemu_plugin_register_atexit_cb(qflex_trace_id, exit_plugin, NULL);
 }
@@ -3,6 +3,7 @@
 
 
 #include "qemu/osdep.h"
+#include "qemu/qemu-plugin.h"
 #include "middleware/libqflex/libqflex-legacy-api.h"
 
 struct mem_access {
@@ -13,29 +14,558 @@ struct mem_access {
     uint8_t is_pair    :1 ;
     uint8_t is_atomic  :1 ;
 
-    size_t size;
-    uint32_t accesses;
+    uint8_t size;
+    uint16_t accesses;
 };
 
+/**
+ * Static record of a translated instruction, shared by every execution.
+ * Kept small and aligned so that two records fill a cache line.
+ */
 typedef struct
 {
-    size_t                  byte_size;
-    char const *            disas_str; //! Super bad, the string my be overwritten in the futur
+    logical_address_t       target_pc_va;
+    // Resolved at translation, a TB is only ever entered from the
+    // physical page it was translated from
+    physical_address_t      target_pc_pa;
     uint32_t                opcode;
-    uint32_t                exception_lvl;
-    mem_op_type_t           type;
 
-    logical_address_t  target_pc_va;
+    uint8_t                 byte_size;
+    uint8_t                 exception_lvl;
+    uint8_t                 branch_type;        // branch_type_t
+    bool                    has_mem_access;
 
-} trace_insn_t;
+    // Decoded once at translation time, a branch never accesses memory
+    union {
+        struct mem_access   mem;            // has_mem_access
+        int32_t             branch_offset;  // direct branches, else TRACE_BRANCH_INDIRECT
+    };
+
+    // Entry in the static instruction dictionary
+    uint32_t                insn_id;
+
+} __attribute__((aligned(32))) trace_insn_t;
+
+/**
+ * Static record of a translated block, for trace-mode=block.
+ * Lives in the translation cache arena next to the instruction records.
+ *
+ * The event is sent on entry to the block, with all its instructions: an
+ * exception or fault in the middle of the block over-counts the ones after
+ * it.
+ */
+typedef struct
+{
+    logical_address_t       pc_va;
+    physical_address_t      pc_pa;
+    uint32_t                n_insns;
+    uint8_t                 exception_lvl;
+    uint8_t                 branch_type;        // of the last instruction
+    uint32_t                insn_id;            // of the first instruction
+
+    uint32_t                opcodes[];
+
+} trace_block_t;
 
 void
 libqflex_trace_init(void);
 
+/**
+ * Disassembly of a record, made on the first request from the guest code
+ * the vCPU sees at the record PC. Valid until the next TB flush.
+ */
+char const *
+trace_disas(unsigned int vcpu_index, trace_insn_t const * insn);
+
+// ─── Counters ────────────────────────────────────────────────────────────────
+
+// Access sizes of the per size counters: 1, 2, 4, 8 and 16 bytes or more
+#define TRACE_COUNT_SIZES (5)
+
+typedef struct
+{
+    uint64_t insns;
+    uint64_t loads;
+    uint64_t stores;
+    uint64_t branches[QEMU_BRANCH_TYPE_COUNT];
+
+    // Only with trace-mode=count or stats=on
+    uint64_t mem_insns;
+    uint64_t atomics;
+    uint64_t loads_by_size[TRACE_COUNT_SIZES];
+    uint64_t stores_by_size[TRACE_COUNT_SIZES];
+    uint64_t exception_lvl[4];
+    // Seen by the memory callback, so only for traced instructions and
+    // never in trace-mode=count
+    uint64_t io;
+    uint64_t undecoded;
+
+    // Keeps the counters of the next vCPU off the last cache line,
+    // whatever the alignment of the scoreboard
+    uint64_t padding[8];
+
+} __attribute__((aligned(64))) trace_count_t;
+
+/**
+ * @param per_block Count instructions once per block, trace-mode=count.
+ */
+void
+trace_count_init(bool per_block);
+
+/**
+ * Emit the per block counter updates of a block being translated, only
+ * with `per_block'.
+ */
+void
+trace_count_register_tb(struct qemu_plugin_tb* tb, uint8_t exception_lvl, bool all);
+
+/**
+ * Emit the inline counter updates of one instruction. Only the instruction
+ * count unless `all', which adds the instruction mix counters.
+ */
+void
+trace_count_register(struct qemu_plugin_insn* insn, trace_insn_t const * rec, bool all);
+
+/**
+ * Count an IO access, from the memory callback of the vCPU.
+ */
+void
+trace_count_io(unsigned int vcpu_index);
+
+/**
+ * Count an access of an instruction the decoder did not recognise.
+ */
+void
+trace_count_undecoded(unsigned int vcpu_index);
+
+/**
+ * Copy the counters of a vCPU, false if the trace plugin is not running.
+ */
+bool
+trace_count_get(size_t vcpu_index, trace_count_t* out);
+
+uint64_t
+trace_count_get_insns(size_t vcpu_index);
+
+/**
+ * Append the counters of every vCPU to `out', one line per vCPU.
+ */
+void
+trace_count_dump(GString* out, size_t n_vcpus, bool all);
+
+void
+trace_count_report(size_t n_vcpus, bool all);
+
+// ─── Sampling ────────────────────────────────────────────────────────────────
+
+/**
+ * Start the sampling schedule, nothing happens when `skip' and `warm' are 0.
+ */
+void
+trace_sample_init(size_t n_vcpus, uint64_t skip, uint64_t warm, uint64_t detail);
+
+/**
+ * Emit the schedule bookkeeping of a block being translated.
+ *
+ * @return true when the block must be traced, false while skipping.
+ */
+bool
+trace_sample_register(struct qemu_plugin_tb* tb);
+
+void
+trace_sample_report(void);
+
+// ─── Basic Block Vectors ─────────────────────────────────────────────────────
+
+/**
+ * Start collecting the basic block vectors of every vCPU, see bbv.c.
+ *
+ * @param path      Prefix of the SimPoint files, `<path>.<vcpu>.bb'.
+ * @param interval  Instructions of a vCPU per vector.
+ */
+void
+trace_bbv_init(size_t n_vcpus, char const * path, uint64_t interval);
+
+/**
+ * Emit the block counter and the interval check of a block being
+ * translated, in every trace mode and sampling phase.
+ */
+void
+trace_bbv_register(struct qemu_plugin_tb* tb);
+
+/**
+ * Write the last interval and the block PCs.
+ */
+void
+trace_bbv_exit(void);
+
+// ─── Filters ─────────────────────────────────────────────────────────────────
+
+#define TRACE_FILTER_NONE   (0)
+#define TRACE_FILTER_FETCH  (1 << 0)
+#define TRACE_FILTER_MEM    (1 << 1)
+
+void
+trace_filter_init(void);
+
+/**
+ * Select the callbacks of an instruction according to the -libqflex
+ * filter-* options.
+ *
+ * @return A mask of TRACE_FILTER_FETCH and TRACE_FILTER_MEM.
+ */
+unsigned int
+trace_filter(trace_insn_t const * insn);
+
+/**
+ * Same as trace_filter() for the block record of trace-mode=block,
+ * decided on the first instruction of the block.
+ */
+bool
+trace_filter_block(trace_insn_t const * first);
+
+// ─── Static Instruction Dictionary ───────────────────────────────────────────
+
+/**
+ * Start the dictionary, also written to `path' unless NULL.
+ */
+void
+trace_dict_init(char const * path);
+
+/**
+ * ID of a translated instruction, given and published to Flexus and to the
+ * dictionary file the first time the instruction is seen.
+ */
+uint32_t
+trace_dict_id(trace_insn_t const * insn);
+
+void
+trace_dict_exit(void);
+
+// ─── Sinks ───────────────────────────────────────────────────────────────────
+
+typedef void (*trace_emit_fn)(unsigned int vcpu_index, memory_transaction_t* tr);
+
+/**
+ * Hand an event to the active sinks, from the vCPU thread.
+ * Set by trace_sink_init().
+ */
+extern trace_emit_fn trace_sink_emit;
+
+/**
+ * TRACE_SINK_* bit of the sink called `name', 0 if there is none.
+ */
+uint32_t
+trace_sink_parse(char const * name);
+
+/**
+ * Start the sinks of `mask', at least one.
+ */
+void
+trace_sink_init(uint32_t mask);
+
+/**
+ * Called on TB flush, before the translation records are dropped.
+ */
+void
+trace_sink_flush(void);
+
+/**
+ * Hand over the pending events and stop the sinks.
+ */
+void
+trace_sink_exit(void);
+
+// ─── Reuse Distance ──────────────────────────────────────────────────────────
+
+/**
+ * Start the reuse distance profiler, see reuse.c.
+ *
+ * @param path      Output of the per-interval curves, NULL for the plugin output.
+ * @param rate      Initial sampling rate, one line or page in `rate'.
+ * @param entries   Bound of the tracked lines or pages, per vCPU and curve.
+ * @param interval  Instructions of a vCPU per interval, 0 for the whole run.
+ */
+void
+trace_reuse_init(size_t n_vcpus, char const * path, uint32_t rate, size_t entries, uint64_t interval);
+
+/**
+ * Profile an event of a vCPU, from the vCPU thread.
+ */
+void
+trace_reuse_access(unsigned int vcpu_index, memory_transaction_t const * tr);
+
+void
+trace_reuse_exit(void);
+
+// ─── Sharing ─────────────────────────────────────────────────────────────────
+
+/**
+ * Start the false sharing and coherence hotspot detector, see sharing.c.
+ *
+ * @param n_lines   Bound of the tracked physical lines, for all vCPUs.
+ * @param top       Most contended lines printed at exit.
+ */
+void
+trace_sharing_init(size_t n_lines, size_t top);
+
+/**
+ * Follow a data access of a vCPU, from the vCPU thread.
+ */
+void
+trace_sharing_access(unsigned int vcpu_index, memory_transaction_t const * tr);
+
+/**
+ * Append the `top' most contended lines, with their vCPUs and instructions.
+ */
+void
+trace_sharing_dump(GString* out, size_t top);
+
+void
+trace_sharing_exit(void);
+
+// ─── Branch Trace ────────────────────────────────────────────────────────────
+
+// branch_offset of the branches whose target is only known at run time
+#define TRACE_BRANCH_INDIRECT   (INT32_MIN)
+
+void
+trace_branch_init(size_t n_vcpus);
+
+/**
+ * Hold the fetch event of a branch until the vCPU executes its next block.
+ */
+void
+trace_branch_defer(unsigned int vcpu_index, memory_transaction_t const * tr, trace_insn_t const * insn);
+
+/**
+ * Send the held branch of a vCPU, `next_pc' being the block it went to.
+ */
+void
+trace_branch_resolve(unsigned int vcpu_index, logical_address_t next_pc);
+
+/**
+ * Send the branches still held, with an unknown target, and print the
+ * outcome counts.
+ */
+void
+trace_branch_exit(void);
+
+// ─── Lock Contention ─────────────────────────────────────────────────────────
+
+/**
+ * Start the lock contention profiler, see lock.c.
+ *
+ * @param top       Most contended lock lines and instructions printed at exit.
+ */
+void
+trace_lock_init(size_t n_vcpus, size_t top);
+
+/**
+ * Follow an access of a vCPU, from the vCPU thread.
+ */
+void
+trace_lock_access(unsigned int vcpu_index, memory_transaction_t const * tr);
+
+/**
+ * Append the per-vCPU totals and the `top' most contended lock lines and
+ * load exclusive instructions.
+ */
+void
+trace_lock_dump(GString* out, size_t top);
+
+void
+trace_lock_exit(void);
+
+// ─── Trace File ──────────────────────────────────────────────────────────────
+
+/**
+ * Create the trace file, see trace-format.h. Exit on failure.
+ *
+ * @param chunk_size Uncompressed bytes per chunk, 0 for the default.
+ */
+void
+trace_file_init(char const * path, size_t n_vcpus, size_t chunk_size);
+
+/**
+ * Append an event of a vCPU, from the vCPU thread.
+ */
+void
+trace_file_write(unsigned int vcpu_index, memory_transaction_t const * tr);
+
+/**
+ * Write the pending chunks and the index. Nothing happens if no trace
+ * file was opened.
+ */
+void
+trace_file_close(void);
+
+// ─── Translation Cache ───────────────────────────────────────────────────────
+
+typedef struct
+{
+    uint64_t entries;
+    // Records superseded by new code at the same host address
+    uint64_t replaced;
+    // Memory held by the record arenas, and handed back by TB flushes
+    uint64_t arena_bytes;
+    uint64_t reclaimed_bytes;
+    uint64_t flushes;
+    // Shard lock acquisitions, and how many of them had to wait
+    uint64_t acquisitions;
+    uint64_t contended;
+    // Contended acquisitions of the most contended shard
+    uint64_t max_contended;
+} trans_cache_stats_t;
+
+void
+trans_cache_init(void);
+
+/**
+ * Return the record of the instruction at `host_pc', NULL if none or if
+ * the cached one does not match the PC, opcode and EL of `key'.
+ */
+trace_insn_t*
+trans_cache_lookup(uint64_t host_pc, trace_insn_t const * key);
+
+/**
+ * Copy `tmpl' into the cache unless another thread inserted a matching
+ * record first. Return the record held by the cache.
+ */
+trace_insn_t*
+trans_cache_insert(uint64_t host_pc, trace_insn_t const * tmpl);
+
+/**
+ * Allocate `size' bytes living as long as the instruction records,
+ * from the shard of `host_pc'.
+ */
+void*
+trans_cache_alloc(uint64_t host_pc, size_t size);
+
+/**
+ * Disassembly of a record stored with trans_cache_set_disas(), NULL if none.
+ */
+char const *
+trans_cache_get_disas(trace_insn_t const * insn);
+
+/**
+ * Keep a copy of the disassembly of a record until the next flush, unless
+ * one was stored already. Return the stored one.
+ */
+char const *
+trans_cache_set_disas(trace_insn_t const * insn, char const * text);
+
+/**
+ * Drop every record. Only valid once QEMU dropped every translation
+ * block, the records are referenced by the generated code.
+ */
+void
+trans_cache_flush(void);
+
+void
+trans_cache_get_stats(trans_cache_stats_t* stats);
+
+void
+trans_cache_destroy(void);
+
+// ─── Ring ────────────────────────────────────────────────────────────────────
+
+/**
+ * Allocate one ring of `ring_size` (power of 2) events per vCPU and start
+ * `nb_consumers` threads draining them into Flexus (0 means one per vCPU).
+ */
+void
+trace_ring_init(size_t n_vcpus, size_t ring_size, size_t nb_consumers);
+
+/**
+ * Append a transaction to the ring of a vCPU, waiting while it is full.
+ * Must only be called from the thread running `vcpu_index`.
+ */
+void
+trace_ring_push(unsigned int vcpu_index, memory_transaction_t const * tr);
+
+/**
+ * Wait until every event pushed so far has been handed to Flexus.
+ */
+void
+trace_ring_drain(void);
+
+/**
+ * Drain the rings, stop the consumers and release the buffers.
+ */
+void
+trace_ring_exit(void);
+
+// ─── Ordered Stream ──────────────────────────────────────────────────────────
+
+/**
+ * Start the merge thread, Flexus then receives the events of every vCPU
+ * in quanta of `quantum' instructions, see order.c.
+ */
+void
+trace_order_init(size_t n_vcpus, uint64_t quantum);
+
+/**
+ * Register the halt and resume callbacks, nothing happens unless started.
+ */
+void
+trace_order_attach(qemu_plugin_id_t id);
+
+/**
+ * Emit the progress bookkeeping of a block being translated.
+ */
+void
+trace_order_register(struct qemu_plugin_tb* tb);
+
+/**
+ * Append an event of a vCPU to its queue, from the vCPU thread. Never waits.
+ */
+void
+trace_order_push(unsigned int vcpu_index, memory_transaction_t const * tr);
+
+/**
+ * Have the merge thread pass a sample phase change to Flexus, false if the
+ * ordered stream is off and the caller has to.
+ */
+bool
+trace_order_sample_phase(sample_phase_t phase);
+
+/**
+ * Have the merge thread publish a dictionary entry to Flexus ahead of the
+ * events of the instruction, false if the ordered stream is off.
+ */
+bool
+trace_order_static_insn(static_insn_t const * insn);
+
+/**
+ * Deliver every pending event and stop the merge thread.
+ */
+void
+trace_order_exit(void);
+
 bool
 decode_armv8_mem_opcode(struct mem_access*, uint32_t);
 
+typedef enum {
+    TRACE_EXCL_NONE,
+    TRACE_EXCL_LOAD,    // LDXR, LDAXR, LDXP, LDAXP
+    TRACE_EXCL_STORE,   // STXR, STLXR, STXP, STLXP
+} trace_excl_t;
+
+/**
+ * Role of an opcode for the exclusive monitor, CAS and LSE atomics are none.
+ */
+trace_excl_t
+decode_armv8_excl_opcode(uint32_t opcode);
+
 bool
 decode_armv8_branch_opcode(branch_type_t*, uint32_t);
 
+/**
+ * Displacement of a direct branch (imm26, imm19 or imm14), false for any
+ * other opcode.
+ */
+bool
+decode_armv8_branch_offset(int32_t* offset, uint32_t opcode);
+
 #endif
@@ -0,0 +1,311 @@
+/*
+ * Translation cache of the trace plugin.
+ *
+ * Maps the host address of a guest instruction to its trace_insn_t record.
+ * The table is split in independently locked shards so that vCPUs translating
+ * at the same time (boot, TB flush, JIT) only serialise when they hit the
+ * same shard.
+ *
+ * Records are packed in per-shard slab arenas. Translated code holds raw
+ * pointers to them as callback userdata, so they can only be reclaimed when
+ * QEMU throws away every translation block, on TB flush. The disassembly of
+ * a record, only made on request, lives in the same arenas.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/units.h"
+
+#include "trace.h"
+
+#define TRANS_CACHE_SHARDS_BITS (6)
+#define TRANS_CACHE_SHARDS      (1 << TRANS_CACHE_SHARDS_BITS)
+
+#define ARENA_SLAB_BYTES        (64 * KiB)
+
+typedef struct arena_slab_t
+{
+    struct arena_slab_t*    next;
+    size_t                  used;
+    uint8_t                 data[] __attribute__((aligned(64)));
+} arena_slab_t;
+
+typedef struct
+{
+    GMutex          lock;
+    GHashTable*     table;
+    // Record -> disassembly, for the records of other shards too
+    GHashTable*     disas;
+
+    // Protected by `lock'
+    arena_slab_t*   slabs;
+    size_t          n_slabs;
+
+    uint64_t        acquisitions;
+    uint64_t        contended;
+    uint64_t        replaced;
+
+} __attribute__((aligned(64))) trans_shard_t;
+
+static trans_shard_t shards[TRANS_CACHE_SHARDS];
+
+static uint64_t n_flushes = 0;
+static uint64_t reclaimed_bytes = 0;
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+/**
+ * Pick a shard from the host address. Instructions are 4 bytes aligned, and
+ * neighbouring instructions are translated together, so mix the bits
+ * to spread a block over several shards.
+ */
+static inline trans_shard_t*
+shard_of(uint64_t host_pc)
+{
+    uint64_t h = (host_pc >> 2) * 0x9E3779B97F4A7C15ull;
+    return &shards[h >> (64 - TRANS_CACHE_SHARDS_BITS)];
+}
+
+/**
+ * Take the shard lock, recording whether another thread was holding it.
+ */
+static inline void
+shard_lock(trans_shard_t* shard)
+{
+    if (!g_mutex_trylock(&shard->lock))
+    {
+        g_mutex_lock(&shard->lock);
+        shard->contended++;
+    }
+    shard->acquisitions++;
+}
+
+/**
+ * Bump allocate `size' bytes from the arena of a shard, the shard lock
+ * must be held.
+ */
+static void*
+arena_alloc(trans_shard_t* shard, size_t size)
+{
+    size = ROUND_UP(size, __alignof__(trace_insn_t));
+    g_assert(size <= ARENA_SLAB_BYTES);
+
+    arena_slab_t* slab = shard->slabs;
+
+    if (slab == NULL || slab->used + size > ARENA_SLAB_BYTES)
+    {
+        slab = g_malloc(sizeof(arena_slab_t) + ARENA_SLAB_BYTES);
+        slab->next = shard->slabs;
+        slab->used = 0;
+
+        shard->slabs = slab;
+        shard->n_slabs++;
+    }
+
+    void* ptr = &slab->data[slab->used];
+    slab->used += size;
+
+    return ptr;
+}
+
+/**
+ * Release every slab but the most recent one, which is rewound.
+ *
+ * @return The number of bytes handed back.
+ */
+static size_t
+arena_reset(trans_shard_t* shard)
+{
+    size_t freed = 0;
+
+    if (shard->slabs == NULL)
+        return 0;
+
+    arena_slab_t* slab = shard->slabs->next;
+    while (slab)
+    {
+        arena_slab_t* next = slab->next;
+        freed += slab->used;
+        g_free(slab);
+        slab = next;
+    }
+
+    freed += shard->slabs->used;
+    shard->slabs->next = NULL;
+    shard->slabs->used = 0;
+    shard->n_slabs = 1;
+
+    return freed;
+}
+
+static inline bool
+trans_matches(trace_insn_t const * a, trace_insn_t const * b)
+{
+    return a->opcode == b->opcode &&
+           a->target_pc_va == b->target_pc_va &&
+           a->exception_lvl == b->exception_lvl;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+void
+trans_cache_init(void)
+{
+    for (size_t i = 0; i < TRANS_CACHE_SHARDS; i++)
+    {
+        g_mutex_init(&shards[i].lock);
+        shards[i].table = g_hash_table_new(NULL, g_direct_equal);
+        shards[i].disas = g_hash_table_new(NULL, g_direct_equal);
+    }
+}
+
+trace_insn_t*
+trans_cache_lookup(uint64_t host_pc, trace_insn_t const * key)
+{
+    trans_shard_t* shard = shard_of(host_pc);
+
+    shard_lock(shard);
+    trace_insn_t* insn = g_hash_table_lookup(shard->table, GSIZE_TO_POINTER(host_pc));
+    g_mutex_unlock(&shard->lock);
+
+    // Host page reused for other code, or same code seen from another context
+    if (insn && !trans_matches(insn, key))
+        return NULL;
+
+    return insn;
+}
+
+trace_insn_t*
+trans_cache_insert(uint64_t host_pc, trace_insn_t const * tmpl)
+{
+    trans_shard_t* shard = shard_of(host_pc);
+
+    shard_lock(shard);
+
+    trace_insn_t* insn = g_hash_table_lookup(shard->table, GSIZE_TO_POINTER(host_pc));
+
+    // Another vCPU translated the same instruction in the meantime
+    if (insn && trans_matches(insn, tmpl))
+    {
+        g_mutex_unlock(&shard->lock);
+        return insn;
+    }
+
+    /**
+     * A stale record stays in the arena: translation blocks still
+     * around may point to it until the next flush.
+     */
+    if (insn)
+        shard->replaced++;
+
+    insn = arena_alloc(shard, sizeof(trace_insn_t));
+    *insn = *tmpl;
+    g_hash_table_insert(shard->table, GSIZE_TO_POINTER(host_pc), insn);
+
+    g_mutex_unlock(&shard->lock);
+
+    return insn;
+}
+
+void*
+trans_cache_alloc(uint64_t host_pc, size_t size)
+{
+    trans_shard_t* shard = shard_of(host_pc);
+
+    shard_lock(shard);
+    void* ptr = arena_alloc(shard, size);
+    g_mutex_unlock(&shard->lock);
+
+    return ptr;
+}
+
+char const *
+trans_cache_get_disas(trace_insn_t const * insn)
+{
+    trans_shard_t* shard = shard_of((uint64_t) insn);
+
+    shard_lock(shard);
+    char const * text = g_hash_table_lookup(shard->disas, insn);
+    g_mutex_unlock(&shard->lock);
+
+    return text;
+}
+
+char const *
+trans_cache_set_disas(trace_insn_t const * insn, char const * text)
+{
+    trans_shard_t* shard = shard_of((uint64_t) insn);
+    size_t const size = MIN(strlen(text) + 1, ARENA_SLAB_BYTES);
+
+    shard_lock(shard);
+
+    // Another vCPU got there first
+    char* stored = g_hash_table_lookup(shard->disas, insn);
+
+    if (stored == NULL)
+    {
+        stored = arena_alloc(shard, size);
+        pstrcpy(stored, size, text);
+        g_hash_table_insert(shard->disas, (gpointer) insn, stored);
+    }
+
+    g_mutex_unlock(&shard->lock);
+
+    return stored;
+}
+
+void
+trans_cache_flush(void)
+{
+    for (size_t i = 0; i < TRANS_CACHE_SHARDS; i++)
+    {
+        shard_lock(&shards[i]);
+        g_hash_table_remove_all(shards[i].table);
+        g_hash_table_remove_all(shards[i].disas);
+        reclaimed_bytes += arena_reset(&shards[i]);
+        g_mutex_unlock(&shards[i].lock);
+    }
+
+    n_flushes++;
+}
+
+void
+trans_cache_get_stats(trans_cache_stats_t* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+
+    for (size_t i = 0; i < TRANS_CACHE_SHARDS; i++)
+    {
+        g_mutex_lock(&shards[i].lock);
+        stats->entries      += g_hash_table_size(shards[i].table);
+        stats->replaced     += shards[i].replaced;
+        stats->arena_bytes  += shards[i].n_slabs * (sizeof(arena_slab_t) + ARENA_SLAB_BYTES);
+        stats->acquisitions += shards[i].acquisitions;
+        stats->contended    += shards[i].contended;
+        stats->max_contended = MAX(stats->max_contended, shards[i].contended);
+        g_mutex_unlock(&shards[i].lock);
+    }
+
+    stats->flushes          = n_flushes;
+    stats->reclaimed_bytes  = reclaimed_bytes;
+}
+
+void
+trans_cache_destroy(void)
+{
+    for (size_t i = 0; i < TRANS_CACHE_SHARDS; i++)
+    {
+        arena_reset(&shards[i]);
+        g_free(shards[i].slabs);
+        shards[i].slabs = NULL;
+        shards[i].n_slabs = 0;
+
+        g_hash_table_destroy(shards[i].table);
+        g_hash_table_destroy(shards[i].disas);
+        shards[i].table = NULL;
+        shards[i].disas = NULL;
+    }
+}
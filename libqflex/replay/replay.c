@@ -0,0 +1,728 @@
+/*
+ * Standalone trace replay, feeds a Flexus library from a file recorded with
+ * -libqflex trace-file, without QEMU nor a guest image.
+ *
+ *   qflex-replay -l libflexus.so -c flexus.cfg [-j threads] [-q quantum] [-o dir] [-D dict] trace
+ *   qflex-replay --diff dir-a dir-b
+ *
+ * The trace is mapped in memory, chunks are decompressed and decoded ahead
+ * by a pool of threads and handed to Flexus from the main thread. The vCPU
+ * streams are merged by instruction count as trace-order=on does, quantum
+ * by quantum and vCPU by vCPU, rather than in the order the chunks were
+ * written. A chunk goes as a whole, in the quantum of its first instruction.
+ * Flexus queries are answered from the state seen in the trace so far. The
+ * second form compares the output directories of two replays, to check
+ * that a configuration is deterministic.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <zlib.h>
+
+#include "../plugins/trace/trace-codec.h"
+#include "../plugins/trace/trace-format.h"
+
+typedef void (*FLEXUS_INIT_t)(
+    QEMU_API_t *,
+    FLEXUS_API_t *,
+    int,
+    const char *,
+    const char *,
+    const char *,
+    const char *);
+
+QEMU_API_t   qemu_api;
+FLEXUS_API_t flexus_api;
+
+typedef struct
+{
+    logical_address_t   pc;
+    uint64_t            n_insns;
+    // Page mappings seen in fetches, VA page -> PA page
+    GHashTable*         pages;
+} replay_vcpu_t;
+
+typedef struct
+{
+    // Decompressed payload, and the events decoded from it.
+    // Block opcodes point into `data'.
+    uint8_t*                data;
+    size_t                  size;
+    memory_transaction_t*   events;
+    size_t                  n_events;
+    bool                    ready;
+} replay_slot_t;
+
+static uint8_t const* trace = NULL;
+static size_t trace_size = 0;
+static qflex_trace_header_t const* header = NULL;
+
+// Chunk offsets in delivery order
+static uint64_t* chunks = NULL;
+static size_t n_chunks = 0;
+
+// Instructions of a vCPU per turn of the merge, as -libqflex order-quantum
+static uint64_t quantum = 10000;
+
+static replay_vcpu_t* vcpus = NULL;
+static bool stop_requested = false;
+
+// Decompression window, chunk `i' goes to slot `i % n_slots'
+static replay_slot_t* slots = NULL;
+static size_t n_slots = 0;
+static size_t next_chunk = 0;
+static size_t delivered = 0;
+static GMutex lock;
+static GCond cond;
+
+#define PAGE_BITS (12)
+
+// ─── QEMU_API_t from the recorded state ─────────────────────────────────────
+
+static size_t
+replay_get_nb_cores(void)
+{
+    return header->n_vcpus;
+}
+
+static logical_address_t
+replay_get_pc(size_t core_index)
+{
+    return vcpus[core_index].pc;
+}
+
+static physical_address_t
+replay_translate_va2pa(size_t core_index, logical_address_t va)
+{
+    gpointer pa_page;
+
+    if (!g_hash_table_lookup_extended(vcpus[core_index].pages,
+                                      GSIZE_TO_POINTER(va >> PAGE_BITS), NULL, &pa_page))
+        return (physical_address_t) -1;
+
+    return (GPOINTER_TO_SIZE(pa_page) << PAGE_BITS) | (va & ((1 << PAGE_BITS) - 1));
+}
+
+static uint64_t
+replay_get_insn_count(size_t core_index)
+{
+    return vcpus[core_index].n_insns;
+}
+
+static uint64_t
+replay_read_register(size_t core_index, register_type_t reg, size_t reg_info)
+{
+    if (reg == PC)
+        return vcpus[core_index].pc;
+
+    // Architectural state is not part of the trace
+    return 0;
+}
+
+static uint64_t
+replay_read_sysreg(size_t core_index, uint8_t op0, uint8_t op1, uint8_t op2,
+                   uint8_t crn, uint8_t crm, bool ignore_permission_check)
+{
+    return 0;
+}
+
+static bool
+replay_has_irq(size_t core_index)
+{
+    return false;
+}
+
+static bool
+replay_is_busy(size_t core_index)
+{
+    return false;
+}
+
+static uint64_t
+replay_cpu_exec(size_t core_index, bool count)
+{
+    g_printerr("qflex-replay: timing mode cannot be replayed from a trace\n");
+    exit(EXIT_FAILURE);
+}
+
+static void
+replay_get_mem(uint8_t* buffer, physical_address_t pa, size_t nb_bytes)
+{
+    memset(buffer, 0, nb_bytes);
+}
+
+static void
+replay_stop(char const * const msg)
+{
+    if (msg)
+        g_printerr("qflex-replay: stop requested: %s\n", msg);
+    stop_requested = true;
+}
+
+static void
+replay_tick(void)
+{
+}
+
+static char*
+replay_disas(size_t core_index, uint64_t addr, size_t size)
+{
+    return g_strdup("");
+}
+
+// ─── Trace ───────────────────────────────────────────────────────────────────
+
+/**
+ * Delivery order of two chunks: quantum of their first instruction, then
+ * vCPU, then file order.
+ */
+static gint
+cmp_chunk(gconstpointer a, gconstpointer b)
+{
+    qflex_trace_index_t const* x = a;
+    qflex_trace_index_t const* y = b;
+    uint64_t const qx = x->first_insn / quantum;
+    uint64_t const qy = y->first_insn / quantum;
+
+    if (qx != qy)
+        return (qx > qy) - (qx < qy);
+
+    if (x->vcpu != y->vcpu)
+        return (x->vcpu > y->vcpu) - (x->vcpu < y->vcpu);
+
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static void
+replay_open(char const * path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        g_printerr("qflex-replay: cannot open %s: %s\n", path, g_strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    trace_size = st.st_size;
+    trace = mmap(NULL, trace_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (trace == MAP_FAILED || trace_size < sizeof(qflex_trace_header_t))
+    {
+        g_printerr("qflex-replay: cannot map %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    header = (qflex_trace_header_t const*) trace;
+
+    if (memcmp(header->magic, QFLEX_TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->format_version != QFLEX_TRACE_FORMAT_VERSION)
+    {
+        g_printerr("qflex-replay: %s is not a trace of format version %d\n",
+                   path, QFLEX_TRACE_FORMAT_VERSION);
+        exit(EXIT_FAILURE);
+    }
+
+    if (header->record_size != sizeof(memory_transaction_t))
+    {
+        g_printerr("qflex-replay: %s was recorded with %u bytes events (schema %u), expected %zu\n",
+                   path, header->record_size, header->schema_version, sizeof(memory_transaction_t));
+        exit(EXIT_FAILURE);
+    }
+
+    madvise((void*) trace, trace_size, MADV_SEQUENTIAL);
+
+    // Use the index when the trace was closed, walk the chunks otherwise
+    g_autoptr(GArray) entries = g_array_new(false, false, sizeof(qflex_trace_index_t));
+
+    if (header->index_offset)
+    {
+        qflex_trace_index_t const* index =
+            (qflex_trace_index_t const*) (trace + header->index_offset);
+
+        g_array_append_vals(entries, index, header->n_chunks);
+    }
+    else
+    {
+        uint64_t offset = sizeof(qflex_trace_header_t);
+
+        while (offset + sizeof(qflex_trace_chunk_t) <= trace_size)
+        {
+            qflex_trace_chunk_t const* chunk = (qflex_trace_chunk_t const*) (trace + offset);
+
+            if (chunk->magic != QFLEX_TRACE_CHUNK_MAGIC ||
+                offset + sizeof(*chunk) + chunk->stored_bytes > trace_size)
+                break;
+
+            qflex_trace_index_t const entry = {
+                .offset     = offset,
+                .vcpu       = chunk->vcpu,
+                .n_events   = chunk->n_events,
+                .first_insn = chunk->first_insn,
+                .n_insns    = chunk->n_insns,
+            };
+            g_array_append_val(entries, entry);
+            offset += sizeof(*chunk) + chunk->stored_bytes;
+        }
+
+        g_printerr("qflex-replay: %s has no index, %u complete chunks found\n", path, entries->len);
+    }
+
+    g_array_sort(entries, cmp_chunk);
+
+    n_chunks = entries->len;
+    chunks = g_new(uint64_t, n_chunks);
+    for (size_t i = 0; i < n_chunks; i++)
+        chunks[i] = g_array_index(entries, qflex_trace_index_t, i).offset;
+
+    vcpus = g_new0(replay_vcpu_t, header->n_vcpus);
+    for (size_t i = 0; i < header->n_vcpus; i++)
+        vcpus[i].pages = g_hash_table_new(NULL, NULL);
+}
+
+/**
+ * Turn the payload of a chunk into an array of events.
+ */
+static void
+replay_decode(qflex_trace_chunk_t const* chunk, replay_slot_t* slot, trace_codec_t* codec)
+{
+    slot->events = g_renew(memory_transaction_t, slot->events, chunk->n_events);
+    slot->n_events = chunk->n_events;
+
+    if (header->encoding == QFLEX_TRACE_ENCODING_COMPACT)
+        trace_codec_reset(codec);
+
+    uint8_t const* p = slot->data;
+
+    for (size_t i = 0; i < chunk->n_events; i++)
+    {
+        memory_transaction_t* tr = &slot->events[i];
+
+        if (header->encoding == QFLEX_TRACE_ENCODING_COMPACT)
+        {
+            p += trace_codec_decode(codec, p, tr);
+            continue;
+        }
+
+        memcpy(tr, p, sizeof(*tr));
+        if (tr->s.type == QEMU_Trans_Instr_Block)
+            tr->block.opcodes = (uint32_t const*) (p + sizeof(*tr));
+
+        p += qflex_trace_event_size(tr);
+    }
+
+    if (p != slot->data + slot->size)
+    {
+        g_printerr("qflex-replay: chunk of vCPU %u does not hold %u events\n",
+                   chunk->vcpu, chunk->n_events);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Decompression thread, works on chunks at most `n_slots' ahead of the
+ * delivery.
+ */
+static gpointer
+replay_inflate_loop(gpointer opaque)
+{
+    g_autofree trace_codec_t* codec = g_new0(trace_codec_t, 1);
+
+    while (true)
+    {
+        g_mutex_lock(&lock);
+
+        size_t const i = next_chunk++;
+        while (i < n_chunks && i >= delivered + n_slots && !stop_requested)
+            g_cond_wait(&cond, &lock);
+
+        g_mutex_unlock(&lock);
+
+        if (i >= n_chunks || stop_requested)
+            return NULL;
+
+        qflex_trace_chunk_t const* chunk = (qflex_trace_chunk_t const*) (trace + chunks[i]);
+        replay_slot_t* slot = &slots[i % n_slots];
+
+        uLongf size = chunk->raw_bytes;
+        slot->data = g_realloc(slot->data, chunk->raw_bytes);
+
+        if (chunk->codec == QFLEX_TRACE_CODEC_NONE)
+            memcpy(slot->data, chunk + 1, chunk->raw_bytes);
+        else if (uncompress(slot->data, &size, (Bytef const*) (chunk + 1), chunk->stored_bytes) != Z_OK ||
+                 size != chunk->raw_bytes)
+        {
+            g_printerr("qflex-replay: corrupted chunk %zu\n", i);
+            exit(EXIT_FAILURE);
+        }
+        slot->size = size;
+
+        replay_decode(chunk, slot, codec);
+
+        g_mutex_lock(&lock);
+        slot->ready = true;
+        g_cond_broadcast(&cond);
+        g_mutex_unlock(&lock);
+    }
+}
+
+static inline bool
+is_instruction(memory_transaction_t const* tr)
+{
+    return tr->s.type == QEMU_Trans_Instr_Block || tr->s.type == QEMU_Trans_Instr_Fetch;
+}
+
+/**
+ * Move the replayed state of a vCPU to the instruction event `tr'.
+ */
+static void
+replay_advance(replay_vcpu_t* v, memory_transaction_t const* tr)
+{
+    v->n_insns += (tr->s.type == QEMU_Trans_Instr_Block) ? tr->block.n_insns : 1;
+    v->pc = tr->s.pc;
+    g_hash_table_insert(v->pages,
+                        GSIZE_TO_POINTER(tr->s.logical_address >> PAGE_BITS),
+                        GSIZE_TO_POINTER(tr->s.physical_address >> PAGE_BITS));
+}
+
+static void
+replay_send(uint32_t vcpu_index, memory_transaction_t* events, size_t n)
+{
+    if (flexus_api.trace_mem_batch)
+        flexus_api.trace_mem_batch(vcpu_index, events, n);
+    else
+        for (size_t i = 0; i < n; i++)
+            flexus_api.trace_mem(vcpu_index, &events[i]);
+}
+
+/**
+ * Hand the events of a chunk to Flexus, updating the replayed state.
+ *
+ * Events go in batches of one instruction event and the accesses that
+ * follow it, the state being moved to that instruction beforehand, so that
+ * Flexus queries made while handling an event see the pc, instruction count
+ * and page mappings up to that event and never those of later ones.
+ */
+static void
+replay_deliver(qflex_trace_chunk_t const* chunk, replay_slot_t* slot)
+{
+    replay_vcpu_t* v = &vcpus[chunk->vcpu];
+    size_t start = 0;
+
+    for (size_t i = 0; i < slot->n_events; i++)
+    {
+        memory_transaction_t const* tr = &slot->events[i];
+
+        if (!is_instruction(tr))
+            continue;
+
+        if (i > start)
+            replay_send(chunk->vcpu, &slot->events[start], i - start);
+
+        replay_advance(v, tr);
+        start = i;
+    }
+
+    if (slot->n_events > start)
+        replay_send(chunk->vcpu, &slot->events[start], slot->n_events - start);
+}
+
+/**
+ * Publish a static instruction dictionary to Flexus before the replay.
+ */
+static void
+replay_publish_dict(char const * path)
+{
+    g_autofree char* data = NULL;
+    gsize size;
+
+    qflex_dict_header_t const* dict_header;
+
+    if (!g_file_get_contents(path, &data, &size, NULL) ||
+        size < sizeof(*dict_header) ||
+        memcmp((dict_header = (qflex_dict_header_t const*) data)->magic,
+               QFLEX_DICT_MAGIC, sizeof(dict_header->magic)) != 0 ||
+        dict_header->format_version != QFLEX_DICT_FORMAT_VERSION ||
+        dict_header->record_size != sizeof(static_insn_t))
+    {
+        g_printerr("qflex-replay: %s is not a dictionary of this build\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    static_insn_t const* entries = (static_insn_t const*) (data + sizeof(*dict_header));
+    size_t const n = (size - sizeof(*dict_header)) / sizeof(static_insn_t);
+
+    for (size_t i = 0; i < n; i++)
+        flexus_api.static_insn(&entries[i]);
+
+    g_print("> REPLAY_DICT: %zu entries\n", n);
+}
+
+// ─── Diff ────────────────────────────────────────────────────────────────────
+
+/**
+ * Compare the regular files of two replay output directories.
+ *
+ * @return The number of files that differ or exist on one side only.
+ */
+static int
+replay_diff(char const * dir_a, char const * dir_b)
+{
+    int differ = 0;
+    char const * const dirs[2] = { dir_a, dir_b };
+
+    for (int side = 0; side < 2; side++)
+    {
+        GDir* dir = g_dir_open(dirs[side], 0, NULL);
+        if (dir == NULL)
+        {
+            g_printerr("qflex-replay: cannot open %s\n", dirs[side]);
+            return -1;
+        }
+
+        char const * name;
+        while ((name = g_dir_read_name(dir)))
+        {
+            g_autofree char* self  = g_build_filename(dirs[side], name, NULL);
+            g_autofree char* other = g_build_filename(dirs[!side], name, NULL);
+
+            if (!g_file_test(self, G_FILE_TEST_IS_REGULAR))
+                continue;
+
+            if (!g_file_test(other, G_FILE_TEST_EXISTS))
+            {
+                g_print("only in %s: %s\n", dirs[side], name);
+                differ++;
+                continue;
+            }
+
+            // Files present on both sides are compared once
+            if (side == 1)
+                continue;
+
+            g_autofree char* a = NULL;
+            g_autofree char* b = NULL;
+            gsize a_len, b_len;
+
+            if (!g_file_get_contents(self, &a, &a_len, NULL) ||
+                !g_file_get_contents(other, &b, &b_len, NULL) ||
+                a_len != b_len || memcmp(a, b, a_len) != 0)
+            {
+                g_print("differ: %s\n", name);
+                differ++;
+            }
+        }
+
+        g_dir_close(dir);
+    }
+
+    g_print("%s\n", differ ? "replays differ" : "replays are identical");
+    return differ;
+}
+
+// ─────────────────────────────────────────────────────────────────────────────
+
+int
+main(int argc, char** argv)
+{
+    char* lib_path = NULL;
+    char* cfg_path = NULL;
+    char* debug_lvl = NULL;
+    char* out_dir = NULL;
+    char* dict_path = NULL;
+    int cycles = 0;
+    int n_threads = 0;
+    gint64 n_quantum = quantum;
+    gboolean diff = false;
+
+    GOptionEntry entries[] = {
+        { "lib-path", 'l', 0, G_OPTION_ARG_FILENAME, &lib_path,  "Flexus library", "PATH" },
+        { "cfg-path", 'c', 0, G_OPTION_ARG_FILENAME, &cfg_path,  "Flexus configuration", "PATH" },
+        { "debug",    'd', 0, G_OPTION_ARG_STRING,   &debug_lvl, "Flexus debug level", "LVL" },
+        { "cycles",   'n', 0, G_OPTION_ARG_INT,      &cycles,    "Flexus cycles", "N" },
+        { "output",   'o', 0, G_OPTION_ARG_FILENAME, &out_dir,   "Flexus output directory", "DIR" },
+        { "jobs",     'j', 0, G_OPTION_ARG_INT,      &n_threads, "Decompression threads", "N" },
+        { "quantum",  'q', 0, G_OPTION_ARG_INT64,    &n_quantum, "Instructions per vCPU turn of the merge", "N" },
+        { "dict",     'D', 0, G_OPTION_ARG_FILENAME, &dict_path, "Static instruction dictionary", "PATH" },
+        { "diff",      0,  0, G_OPTION_ARG_NONE,     &diff,      "Compare two output directories", NULL },
+        { NULL }
+    };
+
+    g_autoptr(GOptionContext) ctx = g_option_context_new("TRACE | --diff DIR DIR");
+    g_option_context_add_main_entries(ctx, entries, NULL);
+
+    g_autoptr(GError) err = NULL;
+    if (!g_option_context_parse(ctx, &argc, &argv, &err))
+    {
+        g_printerr("qflex-replay: %s\n", err->message);
+        return EXIT_FAILURE;
+    }
+
+    if (diff)
+    {
+        if (argc != 3)
+        {
+            g_printerr("qflex-replay: --diff expects two directories\n");
+            return EXIT_FAILURE;
+        }
+        return replay_diff(argv[1], argv[2]) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (argc != 2 || !lib_path || !cfg_path)
+    {
+        g_printerr("%s", g_option_context_get_help(ctx, true, NULL));
+        return EXIT_FAILURE;
+    }
+
+    if (n_quantum <= 0)
+    {
+        g_printerr("qflex-replay: the quantum must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!debug_lvl) debug_lvl = g_strdup("vverb");
+    if (!out_dir) out_dir = g_strdup(".");
+    quantum = n_quantum;
+
+    replay_open(argv[1]);
+
+    // ─── Flexus ──────────────────────────────────────────────────────────
+
+    void* handle = NULL;
+    if ((handle = dlopen(lib_path, RTLD_LAZY)) == NULL)
+    {
+        g_printerr("qflex-replay: while opening %s => %s\n", lib_path, dlerror());
+        return EXIT_FAILURE;
+    }
+
+    FLEXUS_INIT_t flexus = NULL;
+    if ((flexus = (FLEXUS_INIT_t)(dlsym(handle, "flexus_init"))) == NULL)
+    {
+        g_printerr("qflex-replay: cannot find 'flexus_init' in %s: %s\n", lib_path, dlerror());
+        return EXIT_FAILURE;
+    }
+
+    uint32_t api_version = 1;
+    FLEXUS_API_VERSION_t version = NULL;
+    if ((version = (FLEXUS_API_VERSION_t)(dlsym(handle, "flexus_api_version"))) != NULL)
+        api_version = MIN(version(LIBQFLEX_API_VERSION), LIBQFLEX_API_VERSION);
+
+    if (header->schema_version >= 3 && api_version < 3)
+        g_printerr("qflex-replay: warning: the trace may hold block events, unknown to this Flexus\n");
+
+    qemu_api = (QEMU_API_t) {
+        .read_register      = replay_read_register,
+        .read_sys_register  = replay_read_sysreg,
+        .get_num_cores      = replay_get_nb_cores,
+        .translate_va2pa    = replay_translate_va2pa,
+        .get_pc             = replay_get_pc,
+        .has_irq            = replay_has_irq,
+        .cpu_exec           = replay_cpu_exec,
+        .stop               = replay_stop,
+        .get_mem            = replay_get_mem,
+        .tick               = replay_tick,
+        .disassembly        = replay_disas,
+        .is_busy            = replay_is_busy,
+        .get_insn_count     = replay_get_insn_count,
+    };
+
+    g_autofree char* nb_cycles = g_strdup_printf("%d", cycles);
+    g_mkdir_with_parents(out_dir, 0755);
+
+    flexus(&qemu_api, &flexus_api, header->n_vcpus, cfg_path, debug_lvl, nb_cycles, out_dir);
+
+    if (api_version < 2)
+        flexus_api.trace_mem_batch = NULL;
+
+    if (dict_path)
+    {
+        if (api_version >= 6 && flexus_api.static_insn)
+            replay_publish_dict(dict_path);
+        else
+            g_printerr("qflex-replay: warning: this Flexus does not take a dictionary, ignoring %s\n", dict_path);
+    }
+
+    // ─── Replay ──────────────────────────────────────────────────────────
+
+    if (n_threads <= 0)
+        n_threads = MAX(g_get_num_processors() - 1, 1);
+
+    n_slots = 2 * n_threads;
+    slots = g_new0(replay_slot_t, n_slots);
+
+    GThread** threads = g_new(GThread*, n_threads);
+    for (int i = 0; i < n_threads; i++)
+        threads[i] = g_thread_new("qflex-inflate", replay_inflate_loop, NULL);
+
+    uint64_t n_events = 0;
+    uint64_t n_bytes = 0;
+    gint64 const start = g_get_monotonic_time();
+
+    for (size_t i = 0; i < n_chunks && !stop_requested; i++)
+    {
+        replay_slot_t* slot = &slots[i % n_slots];
+
+        g_mutex_lock(&lock);
+        while (!slot->ready)
+            g_cond_wait(&cond, &lock);
+        g_mutex_unlock(&lock);
+
+        qflex_trace_chunk_t const* chunk = (qflex_trace_chunk_t const*) (trace + chunks[i]);
+        replay_deliver(chunk, slot);
+
+        n_events += chunk->n_events;
+        n_bytes  += slot->size;
+
+        g_mutex_lock(&lock);
+        slot->ready = false;
+        delivered++;
+        g_cond_broadcast(&cond);
+        g_mutex_unlock(&lock);
+    }
+
+    double const seconds = (g_get_monotonic_time() - start) / 1e6;
+
+    g_mutex_lock(&lock);
+    stop_requested = true;
+    g_cond_broadcast(&cond);
+    g_mutex_unlock(&lock);
+
+    for (int i = 0; i < n_threads; i++)
+        g_thread_join(threads[i]);
+
+    uint64_t n_insns = 0;
+    for (size_t i = 0; i < header->n_vcpus; i++)
+        n_insns += vcpus[i].n_insns;
+
+    flexus_api.qmp(QMP_FLEXUS_SAVESTATS, "all.stats.out");
+    flexus_api.qmp(QMP_FLEXUS_WRITEMEASUREMENT, "all:all.measurement.out");
+
+    g_print("> REPLAY: %" G_GUINT64_FORMAT " events, %" G_GUINT64_FORMAT " insns in %.3f s\n",
+            n_events, n_insns, seconds);
+    g_print("> REPLAY_THROUGHPUT: %.3f Mevents/s, %.3f Minsns/s, %.1f MB/s (%d threads)\n",
+            n_events / seconds / 1e6, n_insns / seconds / 1e6, n_bytes / seconds / 1e6, n_threads);
+
+    for (size_t i = 0; i < n_slots; i++)
+    {
+        g_free(slots[i].data);
+        g_free(slots[i].events);
+    }
+    g_free(slots);
+    g_free(threads);
+
+    return EXIT_SUCCESS;
+}